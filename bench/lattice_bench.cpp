@@ -0,0 +1,248 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "general/net/message.h"
+#include "general/lattice.h"
+#include "general/lattice_bitset.h"
+#include "general/lattice_roaring.h"
+#include "general/lattice_persistent.h"
+
+/**
+ * Micro benchmarks of lattice operations. Results are printed to stdout as JSON.
+ * Usage: lattice_bench [--max-size N] [--min-time-ms T] [--lattice NAME]
+ */
+
+struct BenchConfig {
+    // largest number of elements in benchmarked sets
+    uint64_t max_size = 10'000'000;
+    // every operation is repeated until it ran at least this long
+    double min_time_ms = 50;
+    // benchmark only lattice with this name. Empty for all
+    std::string lattice;
+};
+
+/**
+ * Input of one benchmark case: two sets of @size elements.
+ * @overlap share of elements of @b that are also in @a.
+ * @density share of universe values present, 1 gives consecutive elements.
+ */
+struct BenchInput {
+    uint64_t size;
+    double overlap;
+    double density;
+    std::vector<uint64_t> a;
+    std::vector<uint64_t> b;
+};
+
+struct NullBuffer : std::streambuf {
+    int overflow(int c) override {
+        return c;
+    }
+};
+
+template<typename T>
+void do_not_optimize(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+bool first_result = true;
+
+void report(const std::string &lattice, const std::string &op, const BenchInput &input,
+            uint64_t iterations, double ns_per_op, uint64_t bytes) {
+    std::cout << (first_result ? "\n" : ",\n") << "    {\"lattice\": \"" << lattice << "\", \"op\": \"" << op
+              << "\", \"size\": " << input.size << ", \"overlap\": " << input.overlap
+              << ", \"density\": " << input.density << ", \"iterations\": " << iterations
+              << ", \"ns_per_op\": " << ns_per_op;
+    if (bytes != 0) {
+        std::cout << ", \"bytes\": " << bytes;
+    }
+    std::cout << "}";
+    std::cout.flush();
+    first_result = false;
+}
+
+/**
+ * Runs @op until it took @config.min_time_ms in total.
+ * @param prepare called before every run outside of measured time
+ * @return number of runs and mean time of one run in nanoseconds
+ */
+std::pair<uint64_t, double> measure(const BenchConfig &config, const std::function<void()> &prepare,
+                                    const std::function<void()> &op) {
+    uint64_t iterations = 0;
+    double total_ns = 0;
+    while (total_ns < config.min_time_ms * 1e6 || iterations == 0) {
+        prepare();
+        auto begin = std::chrono::steady_clock::now();
+        op();
+        auto end = std::chrono::steady_clock::now();
+        total_ns += (double) std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        ++iterations;
+    }
+    return {iterations, total_ns / (double) iterations};
+}
+
+BenchInput make_input(uint64_t size, double overlap, double density, std::mt19937_64 &gen) {
+    BenchInput input{size, overlap, density, {}, {}};
+    // increasing values with mean gap 1 / density, twice as many as one set needs
+    auto stride = (uint64_t) std::max(1.0, 1.0 / density);
+    std::uniform_int_distribution<uint64_t> gap(1, 2 * stride - 1);
+    std::vector<uint64_t> pool(2 * size);
+    uint64_t value = 0;
+    for (auto &elem : pool) {
+        value += gap(gen);
+        elem = value;
+    }
+    std::shuffle(pool.begin(), pool.end(), gen);
+    input.a.assign(pool.begin(), pool.begin() + (ptrdiff_t) size);
+    auto shared = (uint64_t) ((double) size * overlap);
+    input.b.assign(pool.begin(), pool.begin() + (ptrdiff_t) shared);
+    input.b.insert(input.b.end(), pool.begin() + (ptrdiff_t) size, pool.begin() + (ptrdiff_t) (2 * size - shared));
+    std::sort(input.a.begin(), input.a.end());
+    std::sort(input.b.begin(), input.b.end());
+    return input;
+}
+
+template<typename L>
+L make_lattice(const std::vector<uint64_t> &elements) {
+    L result;
+    for (uint64_t elem : elements) {
+        result.insert(elem);
+    }
+    return result;
+}
+
+template<Lattice L>
+void bench_lattice(const std::string &name, const BenchConfig &config, const BenchInput &input,
+                   std::mt19937_64 &gen) {
+    if constexpr (requires { L::MAX_ELEMENT; }) {
+        if (input.a.back() > L::MAX_ELEMENT || input.b.back() > L::MAX_ELEMENT) return;
+    }
+
+    auto [insert_iterations, insert_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(make_lattice<L>(input.a));
+    });
+    report(name, "insert", input, insert_iterations, insert_ns, 0);
+
+    // random order insertion into sorted representations is quadratic
+    if (input.size <= 100'000) {
+        std::vector<uint64_t> shuffled = input.a;
+        std::shuffle(shuffled.begin(), shuffled.end(), gen);
+        auto [iterations, ns] = measure(config, [] {}, [&] {
+            do_not_optimize(make_lattice<L>(shuffled));
+        });
+        report(name, "insert_random", input, iterations, ns, 0);
+    }
+
+    L a = make_lattice<L>(input.a);
+    L b = make_lattice<L>(input.b);
+    L a_copy = make_lattice<L>(input.a);
+    L joined = L::join(a, b);
+
+    auto [join_iterations, join_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(L::join(a, b));
+    });
+    report(name, "join", input, join_iterations, join_ns, 0);
+
+    L target;
+    auto [join_into_iterations, join_into_ns] = measure(config, [&] { target = a; }, [&] {
+        do_not_optimize(target.join_into(b));
+    });
+    report(name, "join_into", input, join_into_iterations, join_into_ns, 0);
+
+    auto [leq_iterations, leq_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(a <= joined);
+    });
+    report(name, "leq", input, leq_iterations, leq_ns, 0);
+
+    auto [eq_iterations, eq_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(a == a_copy);
+    });
+    report(name, "eq", input, eq_iterations, eq_ns, 0);
+
+    auto [neq_iterations, neq_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(a == b);
+    });
+    report(name, "eq_different", input, neq_iterations, neq_ns, 0);
+
+    net::Message serialized;
+    serialized << a;
+    auto [serialize_iterations, serialize_ns] = measure(config, [] {}, [&] {
+        net::Message message;
+        message << a;
+        do_not_optimize(message.get_size());
+    });
+    report(name, "serialize", input, serialize_iterations, serialize_ns, serialized.get_size());
+
+    auto [deserialize_iterations, deserialize_ns] = measure(config, [&] { serialized.cur_pos = 0; }, [&] {
+        L received;
+        serialized >> received;
+        do_not_optimize(received);
+    });
+    report(name, "deserialize", input, deserialize_iterations, deserialize_ns, serialized.get_size());
+
+    net::Message compact = net::Message::build_as(net::Encoding::Compact, a);
+    auto [compact_iterations, compact_ns] = measure(config, [] {}, [&] {
+        do_not_optimize(net::Message::build_as(net::Encoding::Compact, a).get_size());
+    });
+    report(name, "serialize_compact", input, compact_iterations, compact_ns, compact.get_size());
+
+    auto [decompact_iterations, decompact_ns] = measure(config, [&] { compact.cur_pos = 0; }, [&] {
+        L received;
+        compact >> received;
+        do_not_optimize(received);
+    });
+    report(name, "deserialize_compact", input, decompact_iterations, decompact_ns, compact.get_size());
+
+    NullBuffer null_buffer;
+    auto *cout_buffer = std::cout.rdbuf(&null_buffer);
+    auto [log_iterations, log_ns] = measure(config, [] {}, [&] {
+        LOG(INFO) << a;
+    });
+    std::cout.rdbuf(cout_buffer);
+    report(name, "log", input, log_iterations, log_ns, 0);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i += 2) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "Usage: lattice_bench [--max-size N] [--min-time-ms T] [--lattice NAME]" << std::endl;
+            return 1;
+        } else if (arg == "--max-size") {
+            config.max_size = std::stoull(argv[i + 1]);
+        } else if (arg == "--min-time-ms") {
+            config.min_time_ms = std::stod(argv[i + 1]);
+        } else if (arg == "--lattice") {
+            config.lattice = argv[i + 1];
+        } else {
+            std::cerr << "Usage: lattice_bench [--max-size N] [--min-time-ms T] [--lattice NAME]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::mt19937_64 gen(42);
+    std::cout << "{\n  \"benchmarks\": [";
+    for (uint64_t size = 1; size <= config.max_size; size *= 10) {
+        for (double overlap : {0.0, 0.5, 1.0}) {
+            for (double density : {1.0, 0.1, 0.001}) {
+                BenchInput input = make_input(size, overlap, density, gen);
+                auto run = [&]<Lattice L>(const std::string &name) {
+                    if (config.lattice.empty() || config.lattice == name) {
+                        bench_lattice<L>(name, config, input, gen);
+                    }
+                };
+                run.operator()<LatticeSet>("LatticeSet");
+                run.operator()<LatticeBitset>("LatticeBitset");
+                run.operator()<LatticeRoaring>("LatticeRoaring");
+                run.operator()<LatticePersistentSet>("LatticePersistentSet");
+            }
+        }
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
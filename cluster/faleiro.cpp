@@ -0,0 +1,65 @@
+#include <string>
+
+#include "faleiro/acceptor.h"
+#include "faleiro/proposer.h"
+#include "local_cluster.h"
+
+/**
+ * Faleiro process of @LocalCluster. Proposes set of its id, as in coordinator runs
+ */
+struct FaleiroNode {
+    // set before cluster is created
+    static inline bool delta_mode = false;
+
+    FaleiroNode(uint64_t id, uint64_t n, uint64_t, const std::vector<net::ProcessDescriptor> &peers)
+            : protocol(peers[id].port, id, delta_mode), acceptor(protocol), proposer(protocol, id, n) {
+        protocol.server.set_transport(net::Transport::InMemory);
+        for (const auto &peer : peers) {
+            protocol.add_process(peer);
+        }
+        initial_value.insert(id);
+    }
+
+    void start() {
+        protocol.start(&acceptor, &proposer);
+    }
+
+    LatticeSet run() {
+        return proposer.start(initial_value);
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    FaleiroProtocol<LatticeSet> protocol;
+    Acceptor<LatticeSet> acceptor;
+    Proposer<LatticeSet> proposer;
+    LatticeSet initial_value;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && !(argc == 4 && std::string(argv[3]) == "delta")) {
+        LOG(ERROR) << "usage: n f [delta]";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    FaleiroNode::delta_mode = argc == 4;
+    LOG::set_level(ERROR);
+
+    auto begin = std::chrono::steady_clock::now();
+    LocalCluster<FaleiroNode> cluster(n, f);
+    auto started = std::chrono::steady_clock::now();
+    auto results = cluster.run();
+    print_times(std::chrono::duration_cast<std::chrono::microseconds>(started - begin).count(), results);
+
+    std::vector<LatticeSet> values;
+    for (const auto &result : results) {
+        values.push_back(result.first);
+    }
+    if (!is_chain(values)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
@@ -0,0 +1,85 @@
+#include <string>
+
+#include "faleiro_generalized/acceptor.h"
+#include "faleiro_generalized/proposer.h"
+#include "faleiro_generalized/learner.h"
+#include "local_cluster.h"
+
+/**
+ * Generalized Faleiro process of @LocalCluster. Learns n values, value i of process id is set of i * n + id,
+ * as in coordinator runs
+ */
+struct FaleiroGeneralizedNode {
+    // set before cluster is created
+    static inline bool delta_mode = false;
+
+    FaleiroGeneralizedNode(uint64_t id, uint64_t n, uint64_t, const std::vector<net::ProcessDescriptor> &peers)
+            : protocol(peers[id].port, id, delta_mode), acceptor(protocol), proposer(protocol, id, n),
+              learner(protocol, n), initial_value(n) {
+        protocol.server.set_transport(net::Transport::InMemory);
+        for (const auto &peer : peers) {
+            protocol.add_process(peer);
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            initial_value[i].insert(i * n + id);
+        }
+    }
+
+    void start() {
+        protocol.start(&acceptor, &proposer, &learner);
+    }
+
+    std::vector<LatticeSet> run() {
+        std::vector<LatticeSet> results;
+        for (const auto &elem : initial_value) {
+            proposer.receive_value(elem);
+            proposer.start();
+            results.push_back(learner.learn_value(elem));
+        }
+        return results;
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    FaleiroProtocol<LatticeSet> protocol;
+    Acceptor<LatticeSet> acceptor;
+    Proposer<LatticeSet> proposer;
+    Learner<LatticeSet> learner;
+    std::vector<LatticeSet> initial_value;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && !(argc == 4 && std::string(argv[3]) == "delta")) {
+        LOG(ERROR) << "usage: n f [delta]";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    FaleiroGeneralizedNode::delta_mode = argc == 4;
+    LOG::set_level(ERROR);
+
+    auto begin = std::chrono::steady_clock::now();
+    LocalCluster<FaleiroGeneralizedNode> cluster(n, f);
+    auto started = std::chrono::steady_clock::now();
+    auto results = cluster.run();
+    print_times(std::chrono::duration_cast<std::chrono::microseconds>(started - begin).count(), results);
+
+    bool valid = true;
+    std::vector<LatticeSet> all_learnt;
+    for (uint64_t id = 0; id < n; ++id) {
+        const auto &learnt = results[id].first;
+        for (size_t i = 0; i < learnt.size(); ++i) {
+            if (!(cluster.node(id).initial_value[i] <= learnt[i]) || (i > 0 && !(learnt[i - 1] <= learnt[i]))) {
+                LOG(ERROR) << "Invalid results of" << id;
+                valid = false;
+            }
+            all_learnt.push_back(learnt[i]);
+        }
+    }
+    if (!valid || !is_chain(all_learnt)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
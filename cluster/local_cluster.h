@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <latch>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "general/lattice.h"
+#include "general/net/net_async.h"
+
+/**
+ * n nodes of one protocol in one process. Servers of nodes use @net::Transport::InMemory, so a run needs
+ * no sockets, coordinator or start up sleeps, and measures protocol CPU cost without kernel networking.
+ * @tparam Node One process of protocol. Constructed as Node(id, n, f, peers) with descriptors of all nodes,
+ * itself included, and has start() to start its server, run() returning what the process decided, and stop()
+ */
+template<typename Node>
+struct LocalCluster {
+
+    using Result = decltype(std::declval<Node &>().run());
+
+    /**
+     * Create and start every node
+     * @param n Number of nodes
+     * @param f Number of failures tolerated
+     * @param base_port Node i is found on port base_port + i of @net::LocalNetwork
+     */
+    LocalCluster(uint64_t n, uint64_t f, uint64_t base_port = 1) : n(n) {
+        for (uint64_t i = 0; i < n; ++i) {
+            peers.push_back({"local", i, base_port + i});
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            nodes.push_back(std::make_unique<Node>(i, n, f, peers));
+        }
+        for (auto &node : nodes) {
+            node->start();
+        }
+    }
+
+    /**
+     * Stop every node before any is destroyed, late messages may still reach them
+     */
+    ~LocalCluster() {
+        for (auto &node : nodes) {
+            node->stop();
+        }
+    }
+
+    /**
+     * Run every node on its own thread. Threads are released together once all of them started
+     * @return result and running time in microseconds of every node by id
+     */
+    std::vector<std::pair<Result, uint64_t>> run() {
+        std::vector<std::pair<Result, uint64_t>> results(n);
+        std::latch ready((ptrdiff_t) n);
+        std::vector<std::thread> threads;
+        threads.reserve(n);
+        for (uint64_t i = 0; i < n; ++i) {
+            threads.emplace_back([&, i]() {
+                ready.arrive_and_wait();
+                auto begin = std::chrono::steady_clock::now();
+                results[i].first = nodes[i]->run();
+                auto end = std::chrono::steady_clock::now();
+                results[i].second = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        return results;
+    }
+
+    /**
+     * @return node @id
+     */
+    Node &node(uint64_t id) {
+        return *nodes[id];
+    }
+
+private:
+    uint64_t n;
+    std::vector<net::ProcessDescriptor> peers;
+    std::vector<std::unique_ptr<Node>> nodes;
+};
+
+/**
+ * Check that every two values are comparable. Sets of a chain ordered by size are ordered by inclusion,
+ * so n values are checked with n comparisons instead of n^2
+ * @param values Decided values
+ * @return true when values form a chain
+ */
+inline bool is_chain(std::vector<LatticeSet> values) {
+    std::sort(values.begin(), values.end(), [](const LatticeSet &a, const LatticeSet &b) {
+        return a.elements().size() < b.elements().size();
+    });
+    for (size_t i = 1; i < values.size(); ++i) {
+        if (!(values[i - 1] <= values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Print set up time and running times of nodes
+ * @param setup_time Time to create and start nodes in microseconds
+ * @param results Results of @LocalCluster::run
+ */
+template<typename Result>
+void print_times(uint64_t setup_time, const std::vector<std::pair<Result, uint64_t>> &results) {
+    uint64_t total_time = 0;
+    uint64_t max_time = 0;
+    for (const auto &result : results) {
+        total_time += result.second;
+        max_time = std::max(max_time, result.second);
+    }
+    std::cout << "Nodes: " << results.size() << '\n';
+    std::cout << "Setup microseconds: " << setup_time << '\n';
+    std::cout << "Total average time: " << (double) total_time / (double) results.size() << '\n';
+    std::cout << "Max time: " << max_time << std::endl;
+}
@@ -0,0 +1,61 @@
+#include <string>
+
+#include "zheng/zheng_la.h"
+#include "local_cluster.h"
+
+/**
+ * Zheng process of @LocalCluster. Proposes set of its id, as in coordinator runs
+ */
+struct ZhengNode {
+    ZhengNode(uint64_t id, uint64_t n, uint64_t f, const std::vector<net::ProcessDescriptor> &peers)
+            : protocol(peers[id].port, id), la(f, n, id, protocol) {
+        protocol.server.set_transport(net::Transport::InMemory);
+        for (const auto &peer : peers) {
+            if (peer.id != id) {
+                protocol.add_process(peer);
+            }
+        }
+        initial_value.insert(id);
+    }
+
+    void start() {
+        protocol.start(&la);
+    }
+
+    LatticeSet run() {
+        return la.start(initial_value);
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    ProtocolTcp<LatticeSet> protocol;
+    ZhengLA<LatticeSet> la;
+    LatticeSet initial_value;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        LOG(ERROR) << "usage: n f";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    LOG::set_level(ERROR);
+
+    auto begin = std::chrono::steady_clock::now();
+    LocalCluster<ZhengNode> cluster(n, f);
+    auto started = std::chrono::steady_clock::now();
+    auto results = cluster.run();
+    print_times(std::chrono::duration_cast<std::chrono::microseconds>(started - begin).count(), results);
+
+    std::vector<LatticeSet> values;
+    for (const auto &result : results) {
+        values.push_back(result.first);
+    }
+    if (!is_chain(values)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
@@ -167,7 +167,7 @@ struct LACoordinator {
                 L value = read_lattice<L>(sock);
                 results.push_back({id, value});
                 LOG(INFO) << "Result from: " << id << " elapsed time: " << elapsed_time;
-                for (auto elem: value.set) {
+                for (auto elem: value.elements()) {
                     std::cout << elem << ' ';
                 }
                 std::cout << std::endl;
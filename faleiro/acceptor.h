@@ -4,7 +4,7 @@
 #include "general/logger.h"
 #include "protocol.h"
 
-template<typename L>
+template<Lattice L>
 struct Acceptor : AcceptorCallback<L> {
     L accepted_value;
 
@@ -34,7 +34,7 @@ struct Acceptor : AcceptorCallback<L> {
 
     // guard: ?Proposal(proposalNumber, proposedValue, proposerId) && acceptedValue !<= proposedValue
     AcceptorResponse<L> reject(uint64_t proposal_number, const L &proposed_value, uint64_t proposer_id) {
-        accepted_value = L::join(accepted_value, proposed_value);
+        accepted_value.join_into(proposed_value);
         return Nack{proposal_number, accepted_value, proposer_id};
     }
 };
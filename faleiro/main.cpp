@@ -4,11 +4,12 @@
 #include "general/lattice.h"
 #include "acceptor.h"
 #include "proposer.h"
+#include "general/net/env_config.h"
 #include "coordinator/la_coordinator.h"
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        LOG(ERROR) << "usage: ip port coordinator_port coordinator_ip coordinator_client_port";
+    if (argc != 6 && !(argc == 7 && std::string(argv[6]) == "delta")) {
+        LOG(ERROR) << "usage: ip port coordinator_port coordinator_ip coordinator_client_port [delta]";
         throw std::runtime_error("usage");
     }
 
@@ -31,7 +32,8 @@ int main(int argc, char *argv[]) {
 
     LOG(INFO) << "Starting protocol" << port << id;
     // Setup server
-    FaleiroProtocol<LatticeSet> protocol(port);
+    FaleiroProtocol<LatticeSet> protocol(port, id, argc == 7);
+    protocol.compact_types = net::configure_from_env(protocol.server, id, n);
 
     for (const auto &item: peers) {
         protocol.add_process({item.ip_address, item.id, item.port});
@@ -60,7 +62,7 @@ int main(int argc, char *argv[]) {
 
     std::cout << "Answer: " << std::endl;
 
-    for (auto elem: y.set) {
+    for (auto elem: y.elements()) {
         std::cout << elem << ' ';
     }
     std::cout << std::endl;
@@ -72,6 +74,7 @@ int main(int argc, char *argv[]) {
 
     // Wait before stopping protocol
     coordinator_client.wait_for_stop();
+    net::log_send_queue_stats(protocol.server);
     std::this_thread::sleep_for(std::chrono::seconds(1));
     protocol.stop();
 
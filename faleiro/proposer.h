@@ -13,7 +13,7 @@ enum Status {
     Active,
 };
 
-template<typename L>
+template<Lattice L>
 struct Proposer : LatticeAgreement<L>, ProposerCallback<L> {
     uint64_t uid;
     Status status;
@@ -35,8 +35,9 @@ struct Proposer : LatticeAgreement<L>, ProposerCallback<L> {
                                                                        active_proposal_number(0), uid(uid) {}
 
     L start(const L &initial_value) override {
-        propose(initial_value);
+        // locked before proposing, so no ack is notified before start waits for it
         std::unique_lock lk{mt};
+        propose(initial_value);
         while (true) {
             cv.wait(lk);
             auto result = decide();
@@ -66,11 +67,11 @@ struct Proposer : LatticeAgreement<L>, ProposerCallback<L> {
         }
     }
 
-    void process_nack(uint64_t proposal_number, L &value) override {
+    void process_nack(uint64_t proposal_number, const net::Lazy<L> &value) override {
         std::lock_guard lg{mt};
         if (proposal_number == active_proposal_number) {
             LOG(INFO) << "nack received";
-            proposed_value = LatticeSet::join(proposed_value, value);
+            proposed_value.join_into(value.get());
             nack_count += 1;
             cv.notify_one();
         }
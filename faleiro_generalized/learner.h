@@ -3,7 +3,7 @@
 #include <vector>
 #include <map>
 
-template<typename L>
+template<Lattice L>
 struct Learner : LearnerCallback<L> {
     uint64_t n;
     L learnt_value;
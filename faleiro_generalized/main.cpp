@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 
+#include "general/net/env_config.h"
 #include "coordinator_generalized/gla_coordinator.h"
 #include "general/lattice.h"
 #include "acceptor.h"
@@ -8,8 +9,8 @@
 #include "learner.h"
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
-        LOG(ERROR) << "usage: ip port coordinator_port coordinator_ip coordinator_client_port";
+    if (argc != 6 && !(argc == 7 && std::string(argv[6]) == "delta")) {
+        LOG(ERROR) << "usage: ip port coordinator_port coordinator_ip coordinator_client_port [delta]";
         throw std::runtime_error("usage");
     }
 
@@ -32,7 +33,8 @@ int main(int argc, char *argv[]) {
 
     LOG(INFO) << "Starting protocol" << port << id;
     // Setup server
-    FaleiroProtocol<LatticeSet> protocol(port);
+    FaleiroProtocol<LatticeSet> protocol(port, id, argc == 7);
+    protocol.compact_types = net::configure_from_env(protocol.server, id, n);
 
     for (const auto &item: peers) {
         protocol.add_process({item.ip_address, item.id, item.port});
@@ -77,6 +79,7 @@ int main(int argc, char *argv[]) {
 
     // Wait before stopping protocol
     coordinator_client.wait_for_stop();
+    net::log_send_queue_stats(protocol.server);
     protocol.stop();
 }
 
@@ -13,7 +13,7 @@ enum Status {
     Active,
 };
 
-template<typename L>
+template<Lattice L>
 struct Proposer : ProposerCallback<L> {
     uint64_t uid;
     Status status;
@@ -51,9 +51,8 @@ struct Proposer : ProposerCallback<L> {
     }
 
     void propose() {
-        auto tmp = L::join(proposed_value, buffered_values);
-        if (status == Passive && proposed_value < tmp) {
-            proposed_value = tmp;
+        // nothing to propose when buffered values add nothing to the last proposal
+        if (status == Passive && proposed_value.join_into(buffered_values)) {
             status = Status::Active;
             active_proposal_number += 1;
             ack_count = 0;
@@ -66,7 +65,7 @@ struct Proposer : ProposerCallback<L> {
     // Buffer
     void process_internal_receive(const L &value) override {
         std::lock_guard lg{mt};
-        buffered_values = L::join(value, buffered_values);
+        buffered_values.join_into(value);
     }
 
     void process_ack(uint64_t proposal_number) override {
@@ -77,10 +76,10 @@ struct Proposer : ProposerCallback<L> {
         }
     }
 
-    void process_nack(uint64_t proposal_number, L &value) override {
+    void process_nack(uint64_t proposal_number, const net::Lazy<L> &value) override {
         std::lock_guard lg{mt};
         if (proposal_number == active_proposal_number) {
-            proposed_value = LatticeSet::join(proposed_value, value);
+            proposed_value.join_into(value.get());
             nack_count += 1;
             cv.notify_one();
         }
@@ -89,7 +88,7 @@ struct Proposer : ProposerCallback<L> {
     void receive_value(const L &value) {
         std::lock_guard lg{mt};
         protocol.send_internal_receive(value, uid);
-        buffered_values = L::join(value, buffered_values);
+        buffered_values.join_into(value);
         LOG(INFO) << "buffered_values" << buffered_values;
     }
 
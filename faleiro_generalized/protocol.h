@@ -2,6 +2,10 @@
 
 #include <variant>
 #include <vector>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <atomic>
 
 #include "general/net/server.h"
 
@@ -38,7 +42,7 @@ struct AcceptorCallback {
 template<typename L>
 struct ProposerCallback {
     virtual void process_ack(uint64_t proposal_number) = 0;
-    virtual void process_nack(uint64_t proposal_number, L &value) = 0;
+    virtual void process_nack(uint64_t proposal_number, const net::Lazy<L> &value) = 0;
     virtual void process_internal_receive(const L &value) = 0;
 };
 
@@ -56,62 +60,104 @@ enum Recipient : uint8_t {
 enum MessageType : uint8_t {
     Accept = 0,
     NAccept = 1,
-    InternalReceive = 2
+    InternalReceive = 2,
+    // acceptor could not rebuild delta proposal and asks for full value
+    Resync = 3
 };
 
-template<typename L>
+template<Lattice L>
 struct FaleiroProtocol : net::IMessageReceivedCallback {
 
     net::Server server;
 
     std::unordered_map<uint64_t, net::ProcessDescriptor> descriptors;
 
-    explicit FaleiroProtocol(uint64_t port) : server(this, port) {}
+    // id of this process
+    uint64_t id;
+
+    // send only the part of proposals and nacks that the peer is not known to hold
+    bool delta_mode;
+
+    // bit per recipient sent in compact encoding. Incoming messages are decoded in any encoding
+    uint32_t compact_types = 0;
+
+    /**
+     * @param type recipient
+     * @return encoding of messages to @type
+     */
+    net::Encoding encoding_of(uint8_t type) const {
+        return (compact_types >> type) & 1 ? net::Encoding::Compact : net::Encoding::Fixed;
+    }
+
+    /**
+     * FaleiroProtocol constructor
+     * @param port Listen port
+     * @param id Id of this process
+     * @param delta_mode When true proposals and nacks carry deltas instead of full values
+     */
+    FaleiroProtocol(uint64_t port, uint64_t id, bool delta_mode = false) : server(this, port), id(id),
+                                                                           delta_mode(delta_mode) {}
 
     // Send ack to proposer and to all learners
     void send_response(uint64_t to, AcceptorResponse<L> &response) {
         uint8_t isAck = std::holds_alternative<Ack<L>>(response);
         {
             net::Message message;
-            message << ToProposer;
             if (isAck) {
                 LOG(INFO) << ">> sending ack to proposer" << to;
                 Ack<L> res = std::get<Ack<L>>(response);
-                message << Accept << res.proposal_number << res.proposer_id << res.proposed_value;
+                // proposer does not use value of ack, learners get it below
+                message = net::Message::build_as(encoding_of(ToProposer), ToProposer, Accept, res.proposal_number,
+                                                 res.proposer_id, id, net::Lazy<L>(delta_mode ? L{} : res.proposed_value));
             } else {
                 Nack<L> res = std::get<Nack<L>>(response);
                 LOG(INFO) << ">> sending nack to proposer" << to << res.proposed_value;
-                message << NAccept << res.proposal_number << res.proposer_id << res.proposed_value;
+                message = net::Message::build_as(encoding_of(ToProposer), ToProposer, NAccept, res.proposal_number,
+                                                 res.proposer_id, id,
+                                                 net::Lazy<L>(nack_value(to, res.proposal_number, res.proposed_value)));
             }
-            server.send(descriptors.at(to), message);
+            server.send_retrying(descriptors.at(to), message);
         }
 
         // Send ack to all learners
         if (isAck) {
             Ack<L> res = std::get<Ack<L>>(response);
-            net::Message message;
-            message << ToLearner << res.proposal_number << res.proposed_value << res.proposer_id;
-            for (const auto &peer : descriptors) {
-                LOG(INFO) << ">> sending ack to learner" << to;
-                server.send(peer.second, message);
-            }
+            auto message = net::Message::build_as(encoding_of(ToLearner), ToLearner, res.proposal_number,
+                                                  res.proposed_value, res.proposer_id);
+            LOG(INFO) << ">> sending ack to learners" << to;
+            server.broadcast_retrying(descriptors, std::move(message));
         }
     }
 
     void send_internal_receive(const L& value, uint64_t except) {
-        net::Message message;
-        message << ToProposer << InternalReceive << value;
-        for (const auto &peer: descriptors) {
-            if (peer.first == except) continue;
-            LOG(INFO) << ">> send internal receive to" << peer.first;
-            server.send(peer.second, message);
-        }
+        auto message = net::Message::build_as(encoding_of(ToProposer), ToProposer, InternalReceive, value);
+        LOG(INFO) << ">> send internal receive except" << except;
+        server.broadcast_retrying(descriptors, std::move(message), except);
     }
 
     void send_proposal(const L &proposed_value, uint64_t proposal_number, uint64_t proposer_id) {
-        std::thread([&, proposed_value, proposal_number, proposer_id]() {
-            net::Message message;
-            message << ToAcceptor << proposal_number << proposed_value << proposer_id;
+        if (delta_mode) {
+            std::lock_guard lg{delta_mt};
+            sent_proposals[proposal_number] = proposed_value;
+            while (sent_proposals.size() > MAX_DELTA_HISTORY) {
+                sent_proposals.erase(sent_proposals.begin());
+            }
+        }
+        latest_proposal = proposal_number;
+        server.post([this, proposed_value, proposal_number, proposer_id]() {
+            // rejected proposal is sent again until a newer one is proposed
+            auto needed = [this, proposal_number]() { return latest_proposal == proposal_number; };
+            if (!delta_mode) {
+                // every acceptor gets full value, so one message goes to all
+                LOG(INFO) << ">> sending propose" << proposal_number;
+                server.broadcast_retrying(descriptors, net::Message::build_as(encoding_of(ToAcceptor), ToAcceptor,
+                                                                              proposal_number, (uint64_t) 0,
+                                                                              proposed_value, proposer_id),
+                                          net::Server::NO_PROCESS, PROPOSAL_QUEUE_KEY, needed);
+                return;
+            }
+            // messages by delta base. Base 0 means full value
+            std::map<uint64_t, net::SharedMessage> messages;
             for (const auto& peer: descriptors) {
                 try {
                     LOG(INFO) << ">> sending propose to" << peer.first;
@@ -121,12 +167,20 @@ struct FaleiroProtocol : net::IMessageReceivedCallback {
 //                    send_lattice(sock, proposed_value);
 //                    send_number(sock, proposer_id);
 //                    close(sock);
-                    server.send(peer.second, message);
+                    uint64_t base;
+                    auto value = proposal_value(peer.first, proposal_number, proposed_value, messages, base);
+                    auto it = messages.find(base);
+                    if (value) {
+                        auto message = net::Message::build_as(encoding_of(ToAcceptor), ToAcceptor, proposal_number,
+                                                              base, *value, proposer_id);
+                        it = messages.emplace(base, std::make_shared<const net::Message>(std::move(message))).first;
+                    }
+                    server.send_retrying(peer.second, it->second, PROPOSAL_QUEUE_KEY, needed);
                 } catch (std::runtime_error &e) {
                     LOG(ERROR) << "* Exception while send_proposal" << e.what();
                 }
             }
-        }).detach();
+        });
     }
 
     AcceptorCallback<L> *acceptor_callback;
@@ -145,9 +199,17 @@ struct FaleiroProtocol : net::IMessageReceivedCallback {
         message >> destination;
         if (destination == ToAcceptor) {
             uint64_t proposal_number;
+            uint64_t base;
             L proposed_value;
             uint64_t proposer_id;
-            message >> proposal_number >> proposed_value >> proposer_id;
+            message >> proposal_number >> base >> proposed_value >> proposer_id;
+            if (!restore_proposal(proposal_number, base, proposed_value, proposer_id)) {
+                LOG(INFO) << ">> sending resync to" << proposer_id;
+                net::Message response;
+                response << ToProposer << Resync << proposal_number << proposer_id << id << net::Lazy<L>(L{});
+                server.send_retrying(descriptors.at(proposer_id), response);
+                return;
+            }
             acceptor_callback->process_proposal(proposal_number, proposed_value, proposer_id);
         } else if (destination == ToProposer) {
             uint8_t message_type;
@@ -155,15 +217,26 @@ struct FaleiroProtocol : net::IMessageReceivedCallback {
             if (message_type == Accept) {
                 uint64_t proposal_number;
                 uint64_t proposer_id;
-                L lattice;
-                message >> proposal_number >> proposer_id >> lattice;
+                uint64_t acceptor_id;
+                net::Lazy<L> lattice;
+                message >> proposal_number >> proposer_id >> acceptor_id >> lattice;
+                acknowledge(acceptor_id, proposal_number);
                 proposer_callback->process_ack(proposal_number);
             } else if (message_type == NAccept) {
                 uint64_t proposal_number;
                 uint64_t proposer_id;
-                L lattice;
-                message >> proposal_number >> proposer_id >> lattice;
+                uint64_t acceptor_id;
+                net::Lazy<L> lattice;
+                message >> proposal_number >> proposer_id >> acceptor_id >> lattice;
+                acknowledge(acceptor_id, proposal_number);
                 proposer_callback->process_nack(proposal_number, lattice);
+            } else if (message_type == Resync) {
+                uint64_t proposal_number;
+                uint64_t proposer_id;
+                uint64_t acceptor_id;
+                net::Lazy<L> lattice;
+                message >> proposal_number >> proposer_id >> acceptor_id >> lattice;
+                resend_full(acceptor_id, proposal_number, proposer_id);
             } else if (message_type == InternalReceive) {
                 L lattice;
                 message >> lattice;
@@ -191,4 +264,107 @@ struct FaleiroProtocol : net::IMessageReceivedCallback {
     void stop() {
         server.stop();
     }
+
+private:
+    // proposals kept as delta bases
+    static constexpr size_t MAX_DELTA_HISTORY = 16;
+
+    // proposal still queued for an acceptor is replaced by a newer one. Proposals only grow, and delta base
+    // of the newer one is already acknowledged, so the older one is not needed
+    static constexpr uint64_t PROPOSAL_QUEUE_KEY = 1;
+
+    // number of latest proposal of this process. Older proposals rejected by a send queue are not sent again
+    std::atomic<uint64_t> latest_proposal = 0;
+
+    std::mutex delta_mt;
+
+    // proposer side. Recent proposals of this process by proposal number
+    std::map<uint64_t, L> sent_proposals;
+
+    // proposer side. Latest proposal number each acceptor responded to
+    std::unordered_map<uint64_t, uint64_t> acceptor_known;
+
+    // acceptor side. Latest proposal number and value received from each proposer
+    std::unordered_map<uint64_t, std::pair<uint64_t, L>> received_proposals;
+
+    /**
+     * Chooses proposal that @acceptor_id is known to hold and computes delta against it under one lock,
+     * so a concurrent send_proposal can not evict the base in between
+     * @param built messages already built by base. Their value is not computed again
+     * @param base set to proposal number to send delta against. 0 when full value should be sent
+     * @return value to send against @base, nothing when @base is in @built
+     */
+    std::optional<L> proposal_value(uint64_t acceptor_id, uint64_t proposal_number, const L &proposed_value,
+                                    const std::map<uint64_t, net::SharedMessage> &built, uint64_t &base) {
+        std::lock_guard lg{delta_mt};
+        auto stored = sent_proposals.end();
+        auto known = acceptor_known.find(acceptor_id);
+        if (known != acceptor_known.end() && known->second < proposal_number) {
+            stored = sent_proposals.find(known->second);
+        }
+        base = stored == sent_proposals.end() ? 0 : stored->first;
+        if (built.count(base)) return std::nullopt;
+        if (base == 0) return proposed_value;
+        return L::delta(proposed_value, stored->second);
+    }
+
+    /**
+     * Rebuilds full proposal from delta and remembers it as next delta base.
+     * Proposals of one proposer only grow, so any stored proposal between @base and @proposal_number works as base.
+     * @return false when there is a gap and full value is needed
+     */
+    bool restore_proposal(uint64_t proposal_number, uint64_t base, L &proposed_value, uint64_t proposer_id) {
+        if (base == 0 && !delta_mode) return true;
+        std::lock_guard lg{delta_mt};
+        auto &stored = received_proposals[proposer_id];
+        if (base != 0) {
+            if (stored.first < base || stored.first >= proposal_number) {
+                return false;
+            }
+            proposed_value.join_into(stored.second);
+        }
+        if (stored.first < proposal_number) {
+            stored = {proposal_number, proposed_value};
+        }
+        return true;
+    }
+
+    /**
+     * Nack value sent to proposer. In delta mode only the part missing from the rejected proposal.
+     */
+    L nack_value(uint64_t proposer_id, uint64_t proposal_number, const L &accepted_value) {
+        if (!delta_mode) return accepted_value;
+        std::lock_guard lg{delta_mt};
+        auto stored = received_proposals.find(proposer_id);
+        if (stored == received_proposals.end() || stored->second.first != proposal_number) {
+            return accepted_value;
+        }
+        return L::delta(accepted_value, stored->second.second);
+    }
+
+    void acknowledge(uint64_t acceptor_id, uint64_t proposal_number) {
+        if (!delta_mode) return;
+        std::lock_guard lg{delta_mt};
+        auto &known = acceptor_known[acceptor_id];
+        known = std::max(known, proposal_number);
+    }
+
+    void resend_full(uint64_t acceptor_id, uint64_t proposal_number, uint64_t proposer_id) {
+        net::Message message;
+        {
+            std::lock_guard lg{delta_mt};
+            auto it = sent_proposals.find(proposal_number);
+            // only latest proposal is worth resending
+            if (it == sent_proposals.end() || std::next(it) != sent_proposals.end()) return;
+            message = net::Message::build_as(encoding_of(ToAcceptor), ToAcceptor, proposal_number, (uint64_t) 0,
+                                             it->second, proposer_id);
+        }
+        LOG(INFO) << ">> resending full propose to" << acceptor_id;
+        // queued by a posted task like other proposals, so an older proposal can not replace it
+        server.post([this, acceptor_id, proposal_number, message = std::move(message)]() {
+            if (latest_proposal != proposal_number) return;
+            server.send_retrying(descriptors.at(acceptor_id), message, PROPOSAL_QUEUE_KEY,
+                                 [this, proposal_number]() { return latest_proposal == proposal_number; });
+        });
+    }
 };
\ No newline at end of file
@@ -1,12 +1,67 @@
 #pragma once
 
-#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <functional>
 #include <memory>
+#include <cstdint>
 #include <cstddef>
 #include <sstream>
+#include <concepts>
+#include <stdexcept>
+#include <string>
+
+namespace net {
+    struct Message;
+}
+
+/**
+ * Lattice concept. Protocols are parametrized by types satisfying it.
+ * Bottom is the default constructed value. Values are written to and read from @net::Message
+ * with serialize and deserialize, and printed by LOG through operator<< on std::ostream.
+ */
+template<typename L>
+concept Lattice = std::default_initializable<L> && std::copy_constructible<L>
+        && requires(L a, const L &b, net::Message &message, std::ostream &os) {
+    { L::join(b, b) } -> std::same_as<L>;
+    { a.join_into(b) } -> std::same_as<bool>;
+    { L::delta(b, b) } -> std::same_as<L>;
+    { b <= b } -> std::convertible_to<bool>;
+    { b < b } -> std::convertible_to<bool>;
+    { b == b } -> std::convertible_to<bool>;
+    { b.empty() } -> std::convertible_to<bool>;
+    b.serialize(message);
+    a.deserialize(message);
+    os << b;
+};
+
+/**
+ * Lattice that keeps a fingerprint of its value up to date on every change.
+ * Equal values have equal fingerprints, so different fingerprints prove inequality in O(1).
+ */
+template<typename L>
+concept Fingerprinted = Lattice<L> && requires(const L &a) {
+    { a.fingerprint() } -> std::same_as<uint64_t>;
+};
+
+/**
+ * Mixes bits of @x. Used to build fingerprints.
+ * @param x mixed value
+ * @return well distributed hash of @x
+ */
+inline uint64_t fingerprint_mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
 
 /**
  * Set of @uint64_t values. Used as Lattice.
+ * Elements are kept sorted and unique in contiguous memory, so join is a linear merge
+ * and inclusion is a linear (or galloping) scan over two sorted ranges.
+ * Sum of mixed element hashes is kept as fingerprint, so unequal sets are usually told apart in O(1).
  */
 class LatticeSet {
 public:
@@ -14,10 +69,6 @@ public:
 
     LatticeSet() = default;
 
-    LatticeSet(const LatticeSet& other) {
-        set = other.set;
-    }
-
     /**
      * Lattice join operator.
      * @param a first set
@@ -25,25 +76,105 @@ public:
      * @return join of @a and @b
      */
     static Self join(const Self &a, const Self &b) {
-        Self result = a;
-        for (auto &elem : b.set) {
-            result.insert(elem);
+        const Self &larger = a.set.size() >= b.set.size() ? a : b;
+        const Self &smaller = a.set.size() >= b.set.size() ? b : a;
+        Self result;
+        result.set.reserve(a.set.size() + b.set.size());
+        result.set = larger.set;
+        result.hash = larger.hash;
+        result.join_into(smaller);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return elements of @value missing from @known
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result;
+        std::set_difference(value.set.begin(), value.set.end(), known.set.begin(), known.set.end(),
+                            std::back_inserter(result.set));
+        for (uint64_t elem : result.set) {
+            result.hash += fingerprint_mix(elem);
         }
         return result;
     }
 
+    /**
+     * In-place lattice join. Merges @other into this set from the back without a temporary buffer.
+     * @param other joined set
+     * @return true when this set grew. false when @other was already contained
+     */
+    bool join_into(const Self &other) {
+        if (other.set.empty()) return false;
+        if (set.empty()) {
+            set = other.set;
+            hash = other.hash;
+            return true;
+        }
+        if (set.back() < other.set.front()) {
+            set.insert(set.end(), other.set.begin(), other.set.end());
+            hash += other.hash;
+            return true;
+        }
+
+        size_t missing = 0;
+        uint64_t missing_hash = 0;
+        auto it = set.cbegin();
+        for (uint64_t elem : other.set) {
+            it = gallop(it, set.cend(), elem);
+            if (it == set.cend() || *it != elem) {
+                ++missing;
+                missing_hash += fingerprint_mix(elem);
+            } else {
+                ++it;
+            }
+        }
+        if (missing == 0) return false;
+        hash += missing_hash;
+
+        ptrdiff_t i = (ptrdiff_t)set.size() - 1;
+        ptrdiff_t j = (ptrdiff_t)other.set.size() - 1;
+        set.resize(set.size() + missing);
+        ptrdiff_t k = (ptrdiff_t)set.size() - 1;
+        while (j >= 0) {
+            if (i >= 0 && set[i] > other.set[j]) {
+                set[k--] = set[i--];
+            } else if (i >= 0 && set[i] == other.set[j]) {
+                set[k--] = set[i--];
+                --j;
+            } else {
+                set[k--] = other.set[j--];
+            }
+        }
+        return true;
+    }
+
     /**
      * Lattice less or equal operator.
+     * Gallops through @other when this set is much smaller than it, otherwise merges linearly.
      * @param other right set
      * @return true when @other contains all number that this contains. false otherwise
      */
     bool operator<=(const Self &other) const {
-        for (auto elem : set) {
-            if (other.set.count(elem) == 0) {
-                return false;
+        if (set.size() > other.set.size()) return false;
+        if (set.empty()) return true;
+        if (set.front() < other.set.front() || set.back() > other.set.back()) return false;
+
+        if (set.size() * GALLOP_RATIO < other.set.size()) {
+            auto it = other.set.begin();
+            for (uint64_t elem : set) {
+                it = gallop(it, other.set.end(), elem);
+                if (it == other.set.end() || *it != elem) {
+                    return false;
+                }
+                ++it;
             }
+            return true;
         }
-        return true;
+        return std::includes(other.set.begin(), other.set.end(), set.begin(), set.end());
     }
 
     /**
@@ -52,7 +183,7 @@ public:
      * @return true when @other contains all numbers that this contains and this not equal to @other. false otherwise
      */
     bool operator<(const Self &other) const {
-        return *this <= other && *this != other;
+        return set.size() < other.set.size() && *this <= other;
     }
 
     /**
@@ -61,8 +192,7 @@ public:
      * @return true when this contains same values as @other. false otherwise
      */
     bool operator==(const Self &other) const {
-        if (set.size() != other.set.size()) return false;
-        return *this <= other && other <= *this;
+        return hash == other.hash && set == other.set;
     }
 
     /**
@@ -75,15 +205,121 @@ public:
     }
 
     /**
-     * Insert number into set
+     * Insert number into set. Appending in increasing order is O(1).
      * @param elem value that will be inserted
      */
     void insert(uint64_t elem) {
-        set.insert(elem);
+        if (set.empty() || set.back() < elem) {
+            set.push_back(elem);
+            hash += fingerprint_mix(elem);
+            return;
+        }
+        auto it = std::lower_bound(set.begin(), set.end(), elem);
+        if (*it != elem) {
+            set.insert(it, elem);
+            hash += fingerprint_mix(elem);
+        }
     }
 
-public:
+    /**
+     * @return true when set has no elements
+     */
+    [[nodiscard]] bool empty() const {
+        return set.empty();
+    }
+
+    /**
+     * @return elements in increasing order. Read only, so fingerprint always matches them
+     */
+    [[nodiscard]] const std::vector<uint64_t> &elements() const {
+        return set;
+    }
 
-    // actual set
-    std::unordered_set<uint64_t> set;
+    /**
+     * @return sum of mixed hashes of all elements
+     */
+    [[nodiscard]] uint64_t fingerprint() const {
+        return hash;
+    }
+
+    /**
+     * Writes set to stream as sorted list: one block in fixed encoding, gaps in compact encoding.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where set is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) set.size();
+        out.write_sorted(set.data(), set.size());
+    }
+
+    /**
+     * Reads set from stream. Elements are copied in one block.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where set is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        uint64_t size;
+        in >> size;
+        if (size > in.max_elements(sizeof(uint64_t))) {
+            throw std::runtime_error("Invalid set size: " + std::to_string(size));
+        }
+        set.resize(size);
+        in.read_sorted(set.data(), size);
+        normalize();
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '{';
+        for (uint64_t elem : val.set) {
+            os << elem << ',';
+        }
+        return os << '}';
+    }
+
+private:
+
+    /**
+     * Restores sorted unique order and fingerprint after elements were written directly into @set.
+     */
+    void normalize() {
+        if (std::adjacent_find(set.begin(), set.end(), std::greater_equal<>()) != set.end()) {
+            std::sort(set.begin(), set.end());
+            set.erase(std::unique(set.begin(), set.end()), set.end());
+        }
+        hash = 0;
+        for (uint64_t elem : set) {
+            hash += fingerprint_mix(elem);
+        }
+    }
+
+    // actual set. Sorted in increasing order without duplicates
+    std::vector<uint64_t> set;
+
+    // sum of fingerprint_mix of all elements
+    uint64_t hash = 0;
+
+    // other set should be this many times larger before galloping is used in operator<=
+    static constexpr size_t GALLOP_RATIO = 16;
+
+    /**
+     * Exponential search for first position not less than @elem.
+     * @param first start of sorted range
+     * @param last end of sorted range
+     * @param elem searched value
+     * @return iterator to first element not less than @elem
+     */
+    static std::vector<uint64_t>::const_iterator gallop(std::vector<uint64_t>::const_iterator first,
+                                                        std::vector<uint64_t>::const_iterator last,
+                                                        uint64_t elem) {
+        size_t step = 1;
+        auto low = first;
+        while (last - low > (ptrdiff_t)step && *(low + step) < elem) {
+            low += step;
+            step *= 2;
+        }
+        auto high = last - low > (ptrdiff_t)step ? low + step + 1 : last;
+        return std::lower_bound(low, high, elem);
+    }
 };
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <ostream>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Set of small dense @uint64_t values stored as a bitset. Used as Lattice.
+ * Suits element IDs assigned by coordinators (process ids, i * n + id).
+ * Join, less or equal and equality run over whole words with AVX2/SSE kernels when available.
+ */
+class LatticeBitset {
+public:
+    using Self = LatticeBitset;
+
+    // largest element that can be inserted. Bounds memory at 32 MiB per set
+    static constexpr uint64_t MAX_ELEMENT = (1ull << 28) - 1;
+
+    LatticeBitset() = default;
+
+    /**
+     * Lattice join operator.
+     * @param a first set
+     * @param b second set
+     * @return join of @a and @b
+     */
+    static Self join(const Self &a, const Self &b) {
+        const Self &larger = a.words.size() >= b.words.size() ? a : b;
+        const Self &smaller = a.words.size() >= b.words.size() ? b : a;
+        Self result = larger;
+        or_words(result.words.data(), smaller.words.data(), smaller.words.size());
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return elements of @value missing from @known
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result = value;
+        size_t common = std::min(value.words.size(), known.words.size());
+        for (size_t i = 0; i < common; ++i) {
+            result.words[i] &= ~known.words[i];
+        }
+        result.normalize();
+        return result;
+    }
+
+    /**
+     * In-place lattice join.
+     * @param other joined set
+     * @return true when this set grew. false when @other was already contained
+     */
+    bool join_into(const Self &other) {
+        if (other.words.size() > words.size()) {
+            words.resize(other.words.size(), 0);
+            or_words(words.data(), other.words.data(), other.words.size());
+            return true;
+        }
+        return or_words(words.data(), other.words.data(), other.words.size());
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right set
+     * @return true when @other contains all number that this contains. false otherwise
+     */
+    bool operator<=(const Self &other) const {
+        // no trailing zero words, so a longer set has an element beyond @other
+        if (words.size() > other.words.size()) return false;
+        return subset_words(words.data(), other.words.data(), words.size());
+    }
+
+    /**
+     * Lattice less operator.
+     * @param other right set
+     * @return true when @other contains all numbers that this contains and this not equal to @other. false otherwise
+     */
+    bool operator<(const Self &other) const {
+        return *this <= other && *this != other;
+    }
+
+    /**
+     * Lattice equals operator.
+     * @param other right set
+     * @return true when this contains same values as @other. false otherwise
+     */
+    bool operator==(const Self &other) const {
+        if (words.size() != other.words.size()) return false;
+        return equal_words(words.data(), other.words.data(), words.size());
+    }
+
+    /**
+     * Lattice not equals operator
+     * @param other right set
+     * @return true when this not equal to @other. false otherwise
+     */
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * Insert number into set
+     * @param elem value that will be inserted
+     */
+    void insert(uint64_t elem) {
+        if (elem > MAX_ELEMENT) {
+            throw std::runtime_error("Bitset element out of range: " + std::to_string(elem));
+        }
+        size_t idx = elem / 64;
+        if (words.size() <= idx) {
+            words.resize(idx + 1, 0);
+        }
+        words[idx] |= 1ull << (elem % 64);
+    }
+
+    /**
+     * Check whether number is in set
+     * @param elem checked value
+     * @return true when @elem is in set. false otherwise
+     */
+    [[nodiscard]] bool contains(uint64_t elem) const {
+        size_t idx = elem / 64;
+        return idx < words.size() && (words[idx] >> (elem % 64)) & 1;
+    }
+
+    /**
+     * @return true when set has no elements
+     */
+    [[nodiscard]] bool empty() const {
+        return words.empty();
+    }
+
+    /**
+     * @return number of elements in set
+     */
+    [[nodiscard]] size_t size() const {
+        size_t result = 0;
+        for (uint64_t word : words) {
+            result += __builtin_popcountll(word);
+        }
+        return result;
+    }
+
+    /**
+     * Calls @f for every element in increasing order
+     * @param f callable taking @uint64_t
+     */
+    template<typename F>
+    void for_each(F &&f) const {
+        for (size_t i = 0; i < words.size(); ++i) {
+            uint64_t word = words[i];
+            while (word) {
+                f(i * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    /**
+     * Writes set to stream as raw words.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where set is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) words.size();
+        out.write(words.data(), words.size() * sizeof(uint64_t));
+    }
+
+    /**
+     * Reads set from stream as raw words.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where set is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        uint64_t size;
+        in >> size;
+        if (size > in.remaining() / sizeof(uint64_t) || size > MAX_ELEMENT / 64 + 1) {
+            throw std::runtime_error("Invalid bitset size: " + std::to_string(size));
+        }
+        words.resize(size);
+        in.read(words.data(), size * sizeof(uint64_t));
+        normalize();
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '{';
+        val.for_each([&](uint64_t elem) {
+            os << elem << ',';
+        });
+        return os << '}';
+    }
+
+    /**
+     * Drops trailing zero words after @words was written directly.
+     */
+    void normalize() {
+        while (!words.empty() && words.back() == 0) {
+            words.pop_back();
+        }
+    }
+
+public:
+
+    // bit i of words[i / 64] is set when i is in set. Never ends with a zero word
+    std::vector<uint64_t> words;
+
+private:
+
+    // ors @src into @dst. Returns true when some bit of @src was missing from @dst
+    static bool or_words(uint64_t *dst, const uint64_t *src, size_t count) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        __m256i added = _mm256_setzero_si256();
+        for (; i + 4 <= count; i += 4) {
+            __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+            __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+            added = _mm256_or_si256(added, _mm256_andnot_si256(d, s));
+            _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(d, s));
+        }
+        bool changed = !_mm256_testz_si256(added, added);
+#elif defined(__SSE2__)
+        __m128i added = _mm_setzero_si128();
+        for (; i + 2 <= count; i += 2) {
+            __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+            __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+            added = _mm_or_si128(added, _mm_andnot_si128(d, s));
+            _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(d, s));
+        }
+        bool changed = _mm_movemask_epi8(_mm_cmpeq_epi8(added, _mm_setzero_si128())) != 0xFFFF;
+#else
+        bool changed = false;
+#endif
+        for (; i < count; ++i) {
+            changed |= (src[i] & ~dst[i]) != 0;
+            dst[i] |= src[i];
+        }
+        return changed;
+    }
+
+    // true when every bit of @a is set in @b
+    static bool subset_words(const uint64_t *a, const uint64_t *b, size_t count) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 4 <= count; i += 4) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            if (!_mm256_testc_si256(vb, va)) return false;
+        }
+#elif defined(__SSE4_1__)
+        for (; i + 2 <= count; i += 2) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+            if (!_mm_testc_si128(vb, va)) return false;
+        }
+#elif defined(__SSE2__)
+        for (; i + 2 <= count; i += 2) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+            __m128i missing = _mm_andnot_si128(vb, va);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(missing, _mm_setzero_si128())) != 0xFFFF) return false;
+        }
+#endif
+        for (; i < count; ++i) {
+            if (a[i] & ~b[i]) return false;
+        }
+        return true;
+    }
+
+    static bool equal_words(const uint64_t *a, const uint64_t *b, size_t count) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        for (; i + 4 <= count; i += 4) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            __m256i diff = _mm256_xor_si256(va, vb);
+            if (!_mm256_testz_si256(diff, diff)) return false;
+        }
+#elif defined(__SSE2__)
+        for (; i + 2 <= count; i += 2) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) return false;
+        }
+#endif
+        for (; i < count; ++i) {
+            if (a[i] != b[i]) return false;
+        }
+        return true;
+    }
+};
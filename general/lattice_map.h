@@ -0,0 +1,179 @@
+#pragma once
+
+#include <map>
+#include <stdexcept>
+#include <cstdint>
+#include <ostream>
+
+#include "lattice.h"
+
+/**
+ * Map from key to lattice value. Used as Lattice.
+ * Join, delta and less or equal are applied per key. A missing key means bottom,
+ * so bottom values are never stored.
+ * @tparam K key type. Should be trivially copyable
+ * @tparam V value lattice
+ */
+template<typename K, Lattice V>
+class LatticeMap {
+public:
+    using Self = LatticeMap;
+
+    LatticeMap() = default;
+
+    /**
+     * Lattice join operator.
+     * @param a first map
+     * @param b second map
+     * @return map with per key join of @a and @b
+     */
+    static Self join(const Self &a, const Self &b) {
+        Self result = a;
+        result.join_into(b);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return per key delta without bottom values
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result;
+        for (const auto &[key, val] : value.values) {
+            auto it = known.values.find(key);
+            if (it == known.values.end()) {
+                result.values.emplace_hint(result.values.end(), key, val);
+                continue;
+            }
+            V d = V::delta(val, it->second);
+            if (!d.empty()) {
+                result.values.emplace_hint(result.values.end(), key, std::move(d));
+            }
+        }
+        return result;
+    }
+
+    /**
+     * In-place lattice join.
+     * @param other joined map
+     * @return true when some value grew or new key appeared
+     */
+    bool join_into(const Self &other) {
+        bool grew = false;
+        for (const auto &[key, val] : other.values) {
+            auto it = values.lower_bound(key);
+            if (it == values.end() || it->first != key) {
+                values.emplace_hint(it, key, val);
+                grew = true;
+            } else {
+                grew |= it->second.join_into(val);
+            }
+        }
+        return grew;
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right map
+     * @return true when every value is less or equal to the value of @other under the same key
+     */
+    bool operator<=(const Self &other) const {
+        if (values.size() > other.values.size()) return false;
+        auto it = other.values.begin();
+        for (const auto &[key, val] : values) {
+            while (it != other.values.end() && it->first < key) {
+                ++it;
+            }
+            if (it == other.values.end() || it->first != key || !(val <= it->second)) {
+                return false;
+            }
+            ++it;
+        }
+        return true;
+    }
+
+    bool operator<(const Self &other) const {
+        return *this <= other && *this != other;
+    }
+
+    bool operator==(const Self &other) const {
+        return values == other.values;
+    }
+
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * Joins @val into value stored under @key.
+     * @param key updated key
+     * @param val joined value
+     */
+    void insert(const K &key, const V &val) {
+        if (val.empty()) return;
+        auto it = values.lower_bound(key);
+        if (it == values.end() || it->first != key) {
+            values.emplace_hint(it, key, val);
+        } else {
+            it->second.join_into(val);
+        }
+    }
+
+    /**
+     * @return true when every key maps to bottom
+     */
+    [[nodiscard]] bool empty() const {
+        return values.empty();
+    }
+
+    /**
+     * Writes number of keys and then every key and value.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where map is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) values.size();
+        for (const auto &[key, val] : values) {
+            out << key;
+            val.serialize(out);
+        }
+    }
+
+    /**
+     * Reads map written by serialize. Keys should be strictly increasing and values not bottom.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where map is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        uint64_t size;
+        in >> size;
+        values.clear();
+        for (uint64_t i = 0; i < size; ++i) {
+            K key;
+            V val;
+            in >> key;
+            val.deserialize(in);
+            if (val.empty() || (!values.empty() && !(values.rbegin()->first < key))) {
+                throw std::runtime_error("Invalid map entry");
+            }
+            values.emplace_hint(values.end(), key, std::move(val));
+        }
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '[';
+        for (const auto &[key, value] : val.values) {
+            os << key << ':' << value << ',';
+        }
+        return os << ']';
+    }
+
+public:
+
+    // values of keys that are not bottom
+    std::map<K, V> values;
+};
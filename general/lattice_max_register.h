@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+
+/**
+ * Max-register over @uint64_t. Used as Lattice.
+ * Join keeps the larger value, bottom is 0.
+ */
+class LatticeMaxRegister {
+public:
+    using Self = LatticeMaxRegister;
+
+    LatticeMaxRegister() = default;
+
+    explicit LatticeMaxRegister(uint64_t value) : value(value) {}
+
+    /**
+     * Lattice join operator.
+     * @param a first register
+     * @param b second register
+     * @return register holding larger value
+     */
+    static Self join(const Self &a, const Self &b) {
+        return Self(std::max(a.value, b.value));
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return @value when it is larger than @known. bottom otherwise
+     */
+    static Self delta(const Self &value, const Self &known) {
+        return value.value > known.value ? value : Self();
+    }
+
+    /**
+     * In-place lattice join.
+     * @param other joined register
+     * @return true when value grew
+     */
+    bool join_into(const Self &other) {
+        if (other.value <= value) return false;
+        value = other.value;
+        return true;
+    }
+
+    bool operator<=(const Self &other) const {
+        return value <= other.value;
+    }
+
+    bool operator<(const Self &other) const {
+        return value < other.value;
+    }
+
+    bool operator==(const Self &other) const {
+        return value == other.value;
+    }
+
+    bool operator!=(const Self &other) const {
+        return value != other.value;
+    }
+
+    /**
+     * @return true when register holds bottom
+     */
+    [[nodiscard]] bool empty() const {
+        return value == 0;
+    }
+
+    /**
+     * @return register value. It identifies register exactly
+     */
+    [[nodiscard]] uint64_t fingerprint() const {
+        return value;
+    }
+
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << value;
+    }
+
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        in >> value;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        return os << val.value;
+    }
+
+public:
+
+    // current register value
+    uint64_t value = 0;
+};
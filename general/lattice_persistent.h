@@ -0,0 +1,357 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <ostream>
+#include <utility>
+#include <optional>
+
+#include "lattice.h"
+
+/**
+ * Persistent set of @uint64_t values. Used as Lattice.
+ * Elements are stored in an immutable treap whose nodes are shared between values, so copying a set
+ * is a reference count increment and join, delta and insert allocate only the nodes on changed paths.
+ * Node priorities are derived from keys, so every set has exactly one tree shape. This lets
+ * equality and less or equal skip subtrees shared by both sides.
+ */
+class LatticePersistentSet {
+    struct Node;
+    using NodePtr = std::shared_ptr<const Node>;
+
+public:
+    using Self = LatticePersistentSet;
+
+    LatticePersistentSet() = default;
+
+    /**
+     * Lattice join operator.
+     * @param a first set
+     * @param b second set
+     * @return join of @a and @b. Shares nodes with both
+     */
+    static Self join(const Self &a, const Self &b) {
+        Self result;
+        result.root = unite(a.root, b.root);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return elements of @value missing from @known
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result;
+        result.root = difference(value.root, known.root);
+        return result;
+    }
+
+    /**
+     * In-place lattice join. Only this handle changes, other copies keep their value.
+     * @param other joined set
+     * @return true when this set grew. false when @other was already contained
+     */
+    bool join_into(const Self &other) {
+        size_t old_size = size();
+        root = unite(root, other.root);
+        return size() != old_size;
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right set
+     * @return true when @other contains all number that this contains. false otherwise
+     */
+    bool operator<=(const Self &other) const {
+        if (size() > other.size()) return false;
+        return subset(root, other.root);
+    }
+
+    /**
+     * Lattice less operator.
+     * @param other right set
+     * @return true when @other contains all numbers that this contains and this not equal to @other. false otherwise
+     */
+    bool operator<(const Self &other) const {
+        return size() < other.size() && *this <= other;
+    }
+
+    /**
+     * Lattice equals operator. Shape is unique for every set, so trees are compared node by node.
+     * @param other right set
+     * @return true when this contains same values as @other. false otherwise
+     */
+    bool operator==(const Self &other) const {
+        return equal(root, other.root);
+    }
+
+    /**
+     * Lattice not equals operator
+     * @param other right set
+     * @return true when this not equal to @other. false otherwise
+     */
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * Insert number into set. Copies only the path to the new node.
+     * @param elem value that will be inserted
+     */
+    void insert(uint64_t elem) {
+        if (contains(elem)) return;
+        root = unite(root, make_node(elem, nullptr, nullptr));
+    }
+
+    /**
+     * Check whether number is in set
+     * @param elem checked value
+     * @return true when @elem is in set. false otherwise
+     */
+    [[nodiscard]] bool contains(uint64_t elem) const {
+        const Node *node = root.get();
+        while (node) {
+            if (node->key == elem) return true;
+            node = elem < node->key ? node->left.get() : node->right.get();
+        }
+        return false;
+    }
+
+    /**
+     * @return true when set has no elements
+     */
+    [[nodiscard]] bool empty() const {
+        return !root;
+    }
+
+    /**
+     * @return number of elements in set
+     */
+    [[nodiscard]] size_t size() const {
+        return root ? root->size : 0;
+    }
+
+    /**
+     * @return sum of mixed hashes of all elements. Same value as @LatticeSet::fingerprint
+     */
+    [[nodiscard]] uint64_t fingerprint() const {
+        return root ? root->hash : 0;
+    }
+
+    /**
+     * Calls @f for every element in increasing order
+     * @param f callable taking @uint64_t
+     */
+    template<typename F>
+    void for_each(F &&f) const {
+        for_each(root.get(), f);
+    }
+
+    /**
+     * Writes set to stream in @LatticeSet format: number of elements and sorted list of elements.
+     * List is written in chunks, so no copy of the whole set is made.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where set is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) size();
+        uint64_t chunk[SERIALIZE_CHUNK];
+        size_t used = 0;
+        std::optional<uint64_t> previous;
+        for_each([&](uint64_t elem) {
+            chunk[used++] = elem;
+            if (used == SERIALIZE_CHUNK) {
+                out.write_sorted(chunk, used, previous);
+                previous = chunk[used - 1];
+                used = 0;
+            }
+        });
+        out.write_sorted(chunk, used, previous);
+    }
+
+    /**
+     * Reads set from stream. Sorted input is built in linear time.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where set is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        LatticeSet received;
+        received.deserialize(in);
+        root = build(received.elements());
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '{';
+        val.for_each([&](uint64_t elem) {
+            os << elem << ',';
+        });
+        return os << '}';
+    }
+
+private:
+
+    // elements passed to stream at once by serialize
+    static constexpr size_t SERIALIZE_CHUNK = 256;
+
+    struct Node {
+        uint64_t key;
+        uint64_t priority;
+        // number of keys in subtree
+        size_t size;
+        // sum of fingerprint_mix of keys in subtree
+        uint64_t hash;
+        NodePtr left;
+        NodePtr right;
+    };
+
+    NodePtr root;
+
+    static uint64_t priority_of(uint64_t key) {
+        return fingerprint_mix(key ^ 0x5851f42d4c957f2dull);
+    }
+
+    // true when node with key @a should be above node with key @b
+    static bool above(uint64_t a_priority, uint64_t a_key, uint64_t b_priority, uint64_t b_key) {
+        return a_priority != b_priority ? a_priority > b_priority : a_key < b_key;
+    }
+
+    static NodePtr make_node(uint64_t key, NodePtr left, NodePtr right) {
+        auto node = std::make_shared<Node>();
+        node->key = key;
+        node->priority = priority_of(key);
+        node->size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+        node->hash = fingerprint_mix(key) + (left ? left->hash : 0) + (right ? right->hash : 0);
+        node->left = std::move(left);
+        node->right = std::move(right);
+        return node;
+    }
+
+    // same as @node with other children. Returns @node itself when children did not change
+    static NodePtr with_children(const NodePtr &node, NodePtr left, NodePtr right) {
+        if (left == node->left && right == node->right) return node;
+        return make_node(node->key, std::move(left), std::move(right));
+    }
+
+    /**
+     * Splits @node into keys less than @key and keys greater than @key.
+     * @param found set to true when @key is in @node
+     */
+    static std::pair<NodePtr, NodePtr> split(const NodePtr &node, uint64_t key, bool &found) {
+        if (!node) return {nullptr, nullptr};
+        if (node->key == key) {
+            found = true;
+            return {node->left, node->right};
+        }
+        if (node->key < key) {
+            auto [less, greater] = split(node->right, key, found);
+            return {with_children(node, node->left, std::move(less)), std::move(greater)};
+        }
+        auto [less, greater] = split(node->left, key, found);
+        return {std::move(less), with_children(node, std::move(greater), node->right)};
+    }
+
+    // concatenates trees where every key of @a is less than every key of @b
+    static NodePtr concat(const NodePtr &a, const NodePtr &b) {
+        if (!a) return b;
+        if (!b) return a;
+        if (above(a->priority, a->key, b->priority, b->key)) {
+            return with_children(a, a->left, concat(a->right, b));
+        }
+        return with_children(b, concat(a, b->left), b->right);
+    }
+
+    static NodePtr unite(const NodePtr &a, const NodePtr &b) {
+        if (!a || a == b) return b;
+        if (!b) return a;
+        if (above(b->priority, b->key, a->priority, a->key)) return unite(b, a);
+        bool found = false;
+        auto [less, greater] = split(b, a->key, found);
+        return with_children(a, unite(a->left, less), unite(a->right, greater));
+    }
+
+    static NodePtr difference(const NodePtr &a, const NodePtr &b) {
+        if (!a || a == b) return nullptr;
+        if (!b) return a;
+        bool found = false;
+        auto [less, greater] = split(b, a->key, found);
+        auto left = difference(a->left, less);
+        auto right = difference(a->right, greater);
+        if (found) return concat(left, right);
+        return with_children(a, std::move(left), std::move(right));
+    }
+
+    // true when every key of @a is in @b. @b is searched from its root for every unshared subtree of @a
+    static bool subset(const NodePtr &a, const NodePtr &b) {
+        if (!a) return true;
+        const Node *node = b.get();
+        while (node && node->key != a->key) {
+            node = a->key < node->key ? node->left.get() : node->right.get();
+        }
+        if (!node) return false;
+        if (node == a.get()) return true;
+        return subset(a->left, b) && subset(a->right, b);
+    }
+
+    static bool equal(const NodePtr &a, const NodePtr &b) {
+        if (a == b) return true;
+        if (!a || !b) return false;
+        if (a->key != b->key || a->size != b->size || a->hash != b->hash) return false;
+        return equal(a->left, b->left) && equal(a->right, b->right);
+    }
+
+    /**
+     * Builds treap from sorted unique keys with a stack of the rightmost path.
+     * @param keys sorted unique keys
+     * @return root of built treap
+     */
+    static NodePtr build(const std::vector<uint64_t> &keys) {
+        struct Building {
+            uint64_t key;
+            uint64_t priority;
+            size_t left = SIZE_MAX;
+            size_t right = SIZE_MAX;
+        };
+        std::vector<Building> nodes(keys.size());
+        std::vector<size_t> path;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            nodes[i].key = keys[i];
+            nodes[i].priority = priority_of(keys[i]);
+            size_t last = SIZE_MAX;
+            while (!path.empty() && above(nodes[i].priority, nodes[i].key,
+                                          nodes[path.back()].priority, nodes[path.back()].key)) {
+                last = path.back();
+                path.pop_back();
+            }
+            nodes[i].left = last;
+            if (!path.empty()) {
+                nodes[path.back()].right = i;
+            }
+            path.push_back(i);
+        }
+        if (path.empty()) return nullptr;
+        return freeze(nodes, path.front());
+    }
+
+    template<typename Building>
+    static NodePtr freeze(const std::vector<Building> &nodes, size_t i) {
+        if (i == SIZE_MAX) return nullptr;
+        return make_node(nodes[i].key, freeze(nodes, nodes[i].left), freeze(nodes, nodes[i].right));
+    }
+
+    template<typename F>
+    static void for_each(const Node *node, F &f) {
+        while (node) {
+            for_each(node->left.get(), f);
+            f(node->key);
+            node = node->right.get();
+        }
+    }
+};
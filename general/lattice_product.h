@@ -0,0 +1,188 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+#include <ostream>
+
+#include "lattice.h"
+
+/**
+ * Product of lattices. Used as Lattice.
+ * Every operation is applied componentwise, bottom is the tuple of component bottoms.
+ * @tparam Ls component lattices
+ */
+template<Lattice... Ls>
+class LatticeProduct {
+public:
+    using Self = LatticeProduct;
+
+    LatticeProduct() = default;
+
+    explicit LatticeProduct(Ls... components) : components(std::move(components)...) {}
+
+    /**
+     * Lattice join operator.
+     * @param a first product
+     * @param b second product
+     * @return componentwise join of @a and @b
+     */
+    static Self join(const Self &a, const Self &b) {
+        Self result;
+        apply([&](auto &r, const auto &x, const auto &y) {
+            r = std::decay_t<decltype(r)>::join(x, y);
+        }, result, a, b);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return componentwise delta
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result;
+        apply([&](auto &r, const auto &x, const auto &y) {
+            r = std::decay_t<decltype(r)>::delta(x, y);
+        }, result, value, known);
+        return result;
+    }
+
+    /**
+     * In-place lattice join.
+     * @param other joined product
+     * @return true when some component grew
+     */
+    bool join_into(const Self &other) {
+        bool grew = false;
+        apply([&](auto &x, const auto &y) {
+            grew |= x.join_into(y);
+        }, *this, other);
+        return grew;
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right product
+     * @return true when every component is less or equal to the component of @other
+     */
+    bool operator<=(const Self &other) const {
+        bool result = true;
+        apply([&](const auto &x, const auto &y) {
+            result = result && x <= y;
+        }, *this, other);
+        return result;
+    }
+
+    bool operator<(const Self &other) const {
+        return *this <= other && *this != other;
+    }
+
+    bool operator==(const Self &other) const {
+        bool result = true;
+        apply([&](const auto &x, const auto &y) {
+            result = result && x == y;
+        }, *this, other);
+        return result;
+    }
+
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * @return true when every component is bottom
+     */
+    [[nodiscard]] bool empty() const {
+        bool result = true;
+        apply([&](const auto &x) {
+            result = result && x.empty();
+        }, *this);
+        return result;
+    }
+
+    /**
+     * Available when every component keeps a fingerprint.
+     * @return combined fingerprint of components
+     */
+    [[nodiscard]] uint64_t fingerprint() const requires (Fingerprinted<Ls> && ...) {
+        uint64_t result = 0;
+        apply([&](const auto &x) {
+            result = fingerprint_mix(result ^ x.fingerprint());
+        }, *this);
+        return result;
+    }
+
+    /**
+     * Writes components to stream one after another.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where product is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        apply([&](const auto &x) {
+            x.serialize(out);
+        }, *this);
+    }
+
+    /**
+     * Reads components from stream one after another.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where product is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        apply([&](auto &x) {
+            x.deserialize(in);
+        }, *this);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '(';
+        apply([&](const auto &x) {
+            os << x << ',';
+        }, val);
+        return os << ')';
+    }
+
+    /**
+     * @tparam I component index
+     * @return I-th component
+     */
+    template<size_t I>
+    auto &get() {
+        return std::get<I>(components);
+    }
+
+    template<size_t I>
+    const auto &get() const {
+        return std::get<I>(components);
+    }
+
+public:
+
+    // component values
+    std::tuple<Ls...> components;
+
+private:
+
+    /**
+     * Calls @f with I-th component of every product, for every I in order.
+     * @param f callable taking one component of each product
+     * @param products products with same component types
+     */
+    template<typename F, typename... Products>
+    static void apply(F &&f, Products &...products) {
+        apply_impl(f, std::index_sequence_for<Ls...>(), products...);
+    }
+
+    template<typename F, size_t... I, typename... Products>
+    static void apply_impl(F &f, std::index_sequence<I...>, Products &...products) {
+        (apply_one<I>(f, products...), ...);
+    }
+
+    template<size_t I, typename F, typename... Products>
+    static void apply_one(F &f, Products &...products) {
+        f(std::get<I>(products.components)...);
+    }
+};
@@ -0,0 +1,699 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <ostream>
+
+/**
+ * Compressed set of @uint64_t values in the style of roaring bitmaps. Used as Lattice.
+ * Elements are grouped by their high 48 bits. Low 16 bits of each group live in a container
+ * that is a sorted array, a 65536-bit bitmap or a list of runs, whichever is smallest.
+ * Suits very large sets of clustered element IDs.
+ */
+class LatticeRoaring {
+public:
+    using Self = LatticeRoaring;
+
+    /**
+     * Holds low 16 bits of all elements sharing one key.
+     */
+    struct Container {
+        enum Type : uint8_t {
+            Array = 0,
+            Bitmap = 1,
+            Run = 2
+        };
+
+        // array container turns into bitmap above this cardinality
+        static constexpr uint32_t ARRAY_MAX = 4096;
+        static constexpr size_t BITMAP_WORDS = 65536 / 64;
+
+        Type type = Array;
+
+        // number of values in container
+        uint32_t cardinality = 0;
+
+        // Array: sorted values. Run: pairs (start, length - 1) sorted by start, not touching
+        std::vector<uint16_t> values;
+
+        // Bitmap: BITMAP_WORDS words
+        std::vector<uint64_t> words;
+
+        /**
+         * Check whether value is in container
+         * @param value checked value
+         * @return true when @value is in container. false otherwise
+         */
+        [[nodiscard]] bool contains(uint16_t value) const {
+            switch (type) {
+                case Array:
+                    return std::binary_search(values.begin(), values.end(), value);
+                case Bitmap:
+                    return (words[value / 64] >> (value % 64)) & 1;
+                case Run: {
+                    size_t run = find_run(value);
+                    return run < run_count() && values[2 * run] <= value
+                           && value <= values[2 * run] + values[2 * run + 1];
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Calls @f for every value in increasing order
+         * @param f callable taking @uint16_t
+         */
+        template<typename F>
+        void for_each(F &&f) const {
+            if (type == Array) {
+                for (uint16_t value : values) f(value);
+            } else if (type == Bitmap) {
+                for (size_t i = 0; i < BITMAP_WORDS; ++i) {
+                    uint64_t word = words[i];
+                    while (word) {
+                        f((uint16_t) (i * 64 + __builtin_ctzll(word)));
+                        word &= word - 1;
+                    }
+                }
+            } else {
+                for (size_t run = 0; run < run_count(); ++run) {
+                    uint32_t start = values[2 * run];
+                    uint32_t end = start + values[2 * run + 1];
+                    for (uint32_t value = start; value <= end; ++value) f((uint16_t) value);
+                }
+            }
+        }
+
+        /**
+         * Insert value into container
+         * @param value inserted value
+         * @return true when value was not in container
+         */
+        bool insert(uint16_t value) {
+            if (type == Run) {
+                return insert_run(value);
+            }
+            if (type == Array) {
+                auto it = std::lower_bound(values.begin(), values.end(), value);
+                if (it != values.end() && *it == value) return false;
+                values.insert(it, value);
+                ++cardinality;
+                if (cardinality > ARRAY_MAX) to_bitmap();
+                return true;
+            }
+            uint64_t bit = 1ull << (value % 64);
+            if (words[value / 64] & bit) return false;
+            words[value / 64] |= bit;
+            ++cardinality;
+            return true;
+        }
+
+        /**
+         * Container-wise union.
+         * @param other joined container
+         * @return true when this container grew
+         */
+        bool join_into(const Container &other) {
+            uint32_t old_cardinality = cardinality;
+            Type old_type = type;
+            if (type == Run && other.type == Run) {
+                std::vector<uint16_t> merged;
+                merged.reserve(values.size() + other.values.size());
+                size_t i = 0, j = 0;
+                while (i < run_count() || j < other.run_count()) {
+                    const std::vector<uint16_t> *src;
+                    size_t run;
+                    if (j == other.run_count() || (i < run_count() && values[2 * i] <= other.values[2 * j])) {
+                        src = &values;
+                        run = i++;
+                    } else {
+                        src = &other.values;
+                        run = j++;
+                    }
+                    append_run(merged, (*src)[2 * run], (uint32_t) (*src)[2 * run] + (*src)[2 * run + 1]);
+                }
+                values = std::move(merged);
+                cardinality = count_runs_cardinality(values);
+            } else if (type == Array && other.type == Array
+                       && cardinality + other.cardinality <= ARRAY_MAX) {
+                std::vector<uint16_t> merged;
+                merged.reserve(values.size() + other.values.size());
+                std::set_union(values.begin(), values.end(), other.values.begin(), other.values.end(),
+                               std::back_inserter(merged));
+                values = std::move(merged);
+                cardinality = values.size();
+            } else {
+                to_bitmap();
+                if (other.type == Bitmap) {
+                    for (size_t i = 0; i < BITMAP_WORDS; ++i) words[i] |= other.words[i];
+                } else if (other.type == Run) {
+                    for (size_t run = 0; run < other.run_count(); ++run) {
+                        set_range(other.values[2 * run], (uint32_t) other.values[2 * run] + other.values[2 * run + 1]);
+                    }
+                } else {
+                    for (uint16_t value : other.values) words[value / 64] |= 1ull << (value % 64);
+                }
+                cardinality = 0;
+                for (uint64_t word : words) cardinality += __builtin_popcountll(word);
+            }
+            bool grew = cardinality != old_cardinality;
+            if (grew || type != old_type) optimize();
+            return grew;
+        }
+
+        /**
+         * Container-wise inclusion.
+         * @param other right container
+         * @return true when @other contains all values of this container
+         */
+        [[nodiscard]] bool subset_of(const Container &other) const {
+            if (cardinality > other.cardinality) return false;
+            if (type == Bitmap && other.type == Bitmap) {
+                for (size_t i = 0; i < BITMAP_WORDS; ++i) {
+                    if (words[i] & ~other.words[i]) return false;
+                }
+                return true;
+            }
+            if (type == Run && other.type == Run) {
+                size_t j = 0;
+                for (size_t run = 0; run < run_count(); ++run) {
+                    uint32_t start = values[2 * run];
+                    uint32_t end = start + values[2 * run + 1];
+                    while (j < other.run_count() && (uint32_t) other.values[2 * j] + other.values[2 * j + 1] < start) ++j;
+                    if (j == other.run_count() || other.values[2 * j] > start
+                        || (uint32_t) other.values[2 * j] + other.values[2 * j + 1] < end) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            if (type == Array && other.type == Array) {
+                return std::includes(other.values.begin(), other.values.end(), values.begin(), values.end());
+            }
+            bool result = true;
+            for_each([&](uint16_t value) {
+                result = result && other.contains(value);
+            });
+            return result;
+        }
+
+        /**
+         * Container equality. Representations may differ.
+         * @param other right container
+         * @return true when both contain same values
+         */
+        bool operator==(const Container &other) const {
+            if (cardinality != other.cardinality) return false;
+            if (type == other.type) {
+                return type == Bitmap ? words == other.words : values == other.values;
+            }
+            return subset_of(other);
+        }
+
+        /**
+         * Picks the smallest of array, bitmap and run representation.
+         */
+        void optimize() {
+            switch (smallest_type()) {
+                case Run:
+                    to_runs();
+                    break;
+                case Array:
+                    to_array();
+                    break;
+                case Bitmap:
+                    to_bitmap();
+                    break;
+            }
+        }
+
+        /**
+         * Checks invariants of a container received from network and recomputes its cardinality.
+         * @return true when container is well formed and not empty
+         */
+        bool validate() {
+            if (type == Array) {
+                if (values.size() > ARRAY_MAX) return false;
+                for (size_t i = 1; i < values.size(); ++i) {
+                    if (values[i - 1] >= values[i]) return false;
+                }
+                cardinality = values.size();
+            } else if (type == Bitmap) {
+                if (words.size() != BITMAP_WORDS) return false;
+                cardinality = 0;
+                for (uint64_t word : words) cardinality += __builtin_popcountll(word);
+            } else if (type == Run) {
+                if (values.size() % 2 != 0) return false;
+                for (size_t run = 0; run < run_count(); ++run) {
+                    uint32_t start = values[2 * run];
+                    if (start + values[2 * run + 1] > 0xFFFF) return false;
+                    if (run > 0 && start <= (uint32_t) values[2 * run - 2] + values[2 * run - 1] + 1) return false;
+                }
+                cardinality = count_runs_cardinality(values);
+            } else {
+                return false;
+            }
+            return cardinality > 0;
+        }
+
+        [[nodiscard]] size_t run_count() const {
+            return type == Run ? values.size() / 2 : 0;
+        }
+
+        /**
+         * Number of maximal runs of consecutive values
+         */
+        [[nodiscard]] size_t count_runs() const {
+            if (type == Run) return run_count();
+            if (type == Array) {
+                size_t runs = 0;
+                for (size_t i = 0; i < values.size(); ++i) {
+                    if (i == 0 || values[i] != values[i - 1] + 1) ++runs;
+                }
+                return runs;
+            }
+            size_t runs = 0;
+            uint64_t carry = 0;
+            for (uint64_t word : words) {
+                // bits that are set while previous bit is not
+                runs += __builtin_popcountll(word & ~((word << 1) | carry));
+                carry = word >> 63;
+            }
+            return runs;
+        }
+
+        void to_bitmap() {
+            if (type == Bitmap) return;
+            std::vector<uint64_t> bits(BITMAP_WORDS, 0);
+            for_each([&](uint16_t value) {
+                bits[value / 64] |= 1ull << (value % 64);
+            });
+            words = std::move(bits);
+            values.clear();
+            values.shrink_to_fit();
+            type = Bitmap;
+        }
+
+        void to_array() {
+            if (type == Array) return;
+            std::vector<uint16_t> result;
+            result.reserve(cardinality);
+            for_each([&](uint16_t value) {
+                result.push_back(value);
+            });
+            values = std::move(result);
+            words.clear();
+            words.shrink_to_fit();
+            type = Array;
+        }
+
+        void to_runs() {
+            if (type == Run) return;
+            std::vector<uint16_t> result;
+            for_each([&](uint16_t value) {
+                append_run(result, value, value);
+            });
+            values = std::move(result);
+            words.clear();
+            words.shrink_to_fit();
+            type = Run;
+        }
+
+        /**
+         * @return representation @optimize would pick, without converting
+         */
+        [[nodiscard]] Type smallest_type() const {
+            size_t run_bytes = 4 * count_runs();
+            size_t array_bytes = cardinality <= ARRAY_MAX ? 2 * cardinality : SIZE_MAX;
+            size_t bitmap_bytes = 8 * BITMAP_WORDS;
+            if (run_bytes < array_bytes && run_bytes < bitmap_bytes) return Run;
+            return array_bytes <= bitmap_bytes ? Array : Bitmap;
+        }
+
+    private:
+
+        /**
+         * Insert into run container, extending or merging neighbour runs
+         * @return true when value was not in container
+         */
+        bool insert_run(uint16_t value) {
+            size_t run = find_run(value);
+            size_t next = run == run_count() ? 0 : run + 1;
+            if (run < run_count()) {
+                uint32_t end = (uint32_t) values[2 * run] + values[2 * run + 1];
+                if (value <= end) return false;
+                if (value == end + 1) {
+                    ++values[2 * run + 1];
+                    ++cardinality;
+                    // value closes the gap to next run
+                    if (next < run_count() && values[2 * next] == value + 1) {
+                        values[2 * run + 1] += values[2 * next + 1] + 1;
+                        values.erase(values.begin() + (ptrdiff_t) (2 * next), values.begin() + (ptrdiff_t) (2 * next + 2));
+                    }
+                    return true;
+                }
+            }
+            if (next < run_count() && values[2 * next] == value + 1) {
+                --values[2 * next];
+                ++values[2 * next + 1];
+            } else {
+                values.insert(values.begin() + (ptrdiff_t) (2 * next), {value, (uint16_t) 0});
+            }
+            ++cardinality;
+            return true;
+        }
+
+        // index of last run starting at or before @value, or run_count() when there is none
+        [[nodiscard]] size_t find_run(uint16_t value) const {
+            size_t low = 0, high = run_count();
+            while (low < high) {
+                size_t mid = (low + high) / 2;
+                if (values[2 * mid] <= value) {
+                    low = mid + 1;
+                } else {
+                    high = mid;
+                }
+            }
+            return low == 0 ? run_count() : low - 1;
+        }
+
+        void set_range(uint32_t start, uint32_t end) {
+            for (uint32_t value = start; value <= end;) {
+                if (value % 64 == 0 && value + 63 <= end) {
+                    words[value / 64] = ~0ull;
+                    value += 64;
+                } else {
+                    words[value / 64] |= 1ull << (value % 64);
+                    ++value;
+                }
+            }
+        }
+
+        // appends [start, end] to sorted runs, merging with last run when they touch
+        static void append_run(std::vector<uint16_t> &runs, uint32_t start, uint32_t end) {
+            if (!runs.empty()) {
+                uint32_t last_start = runs[runs.size() - 2];
+                uint32_t last_end = last_start + runs.back();
+                if (start <= last_end + 1) {
+                    if (end > last_end) runs.back() = (uint16_t) (end - last_start);
+                    return;
+                }
+            }
+            runs.push_back((uint16_t) start);
+            runs.push_back((uint16_t) (end - start));
+        }
+
+        static uint32_t count_runs_cardinality(const std::vector<uint16_t> &runs) {
+            uint32_t result = 0;
+            for (size_t i = 0; i + 1 < runs.size(); i += 2) result += (uint32_t) runs[i + 1] + 1;
+            return result;
+        }
+    };
+
+    LatticeRoaring() = default;
+
+    /**
+     * Lattice join operator.
+     * @param a first set
+     * @param b second set
+     * @return join of @a and @b
+     */
+    static Self join(const Self &a, const Self &b) {
+        Self result = a;
+        result.join_into(b);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return elements of @value missing from @known
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result;
+        size_t j = 0;
+        for (size_t i = 0; i < value.keys.size(); ++i) {
+            while (j < known.keys.size() && known.keys[j] < value.keys[i]) ++j;
+            if (j == known.keys.size() || known.keys[j] != value.keys[i]) {
+                result.keys.push_back(value.keys[i]);
+                result.containers.push_back(value.containers[i]);
+                continue;
+            }
+            Container missing;
+            const Container &known_container = known.containers[j];
+            value.containers[i].for_each([&](uint16_t low) {
+                if (!known_container.contains(low)) missing.insert(low);
+            });
+            if (missing.cardinality > 0) {
+                missing.optimize();
+                result.keys.push_back(value.keys[i]);
+                result.containers.push_back(std::move(missing));
+            }
+        }
+        return result;
+    }
+
+    /**
+     * In-place lattice join. Containers with equal keys are joined container-wise.
+     * @param other joined set
+     * @return true when this set grew. false when @other was already contained
+     */
+    bool join_into(const Self &other) {
+        bool grew = false;
+        bool new_keys = false;
+        size_t i = 0;
+        for (size_t j = 0; j < other.keys.size(); ++j) {
+            while (i < keys.size() && keys[i] < other.keys[j]) ++i;
+            if (i < keys.size() && keys[i] == other.keys[j]) {
+                grew |= containers[i].join_into(other.containers[j]);
+            } else {
+                new_keys = true;
+            }
+        }
+        if (!new_keys) return grew;
+
+        std::vector<uint64_t> merged_keys;
+        std::vector<Container> merged_containers;
+        merged_keys.reserve(keys.size() + other.keys.size());
+        merged_containers.reserve(keys.size() + other.keys.size());
+        i = 0;
+        size_t j = 0;
+        while (i < keys.size() || j < other.keys.size()) {
+            if (j == other.keys.size() || (i < keys.size() && keys[i] <= other.keys[j])) {
+                if (j < other.keys.size() && keys[i] == other.keys[j]) ++j;
+                merged_keys.push_back(keys[i]);
+                merged_containers.push_back(std::move(containers[i]));
+                ++i;
+            } else {
+                merged_keys.push_back(other.keys[j]);
+                merged_containers.push_back(other.containers[j]);
+                // other side may have grown by inserts into a larger representation
+                merged_containers.back().optimize();
+                ++j;
+            }
+        }
+        keys = std::move(merged_keys);
+        containers = std::move(merged_containers);
+        return true;
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right set
+     * @return true when @other contains all number that this contains. false otherwise
+     */
+    bool operator<=(const Self &other) const {
+        if (keys.size() > other.keys.size()) return false;
+        size_t j = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            j = std::lower_bound(other.keys.begin() + j, other.keys.end(), keys[i]) - other.keys.begin();
+            if (j == other.keys.size() || other.keys[j] != keys[i]) return false;
+            if (!containers[i].subset_of(other.containers[j])) return false;
+        }
+        return true;
+    }
+
+    /**
+     * Lattice less operator.
+     * @param other right set
+     * @return true when @other contains all numbers that this contains and this not equal to @other. false otherwise
+     */
+    bool operator<(const Self &other) const {
+        return size() < other.size() && *this <= other;
+    }
+
+    /**
+     * Lattice equals operator.
+     * @param other right set
+     * @return true when this contains same values as @other. false otherwise
+     */
+    bool operator==(const Self &other) const {
+        return keys == other.keys && containers == other.containers;
+    }
+
+    /**
+     * Lattice not equals operator
+     * @param other right set
+     * @return true when this not equal to @other. false otherwise
+     */
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * Insert number into set
+     * @param elem value that will be inserted
+     */
+    void insert(uint64_t elem) {
+        uint64_t key = elem >> 16;
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        size_t idx = it - keys.begin();
+        if (it == keys.end() || *it != key) {
+            keys.insert(it, key);
+            containers.insert(containers.begin() + (ptrdiff_t) idx, Container{});
+        }
+        containers[idx].insert((uint16_t) (elem & 0xFFFF));
+    }
+
+    /**
+     * Check whether number is in set
+     * @param elem checked value
+     * @return true when @elem is in set. false otherwise
+     */
+    [[nodiscard]] bool contains(uint64_t elem) const {
+        auto it = std::lower_bound(keys.begin(), keys.end(), elem >> 16);
+        return it != keys.end() && *it == elem >> 16
+               && containers[it - keys.begin()].contains((uint16_t) (elem & 0xFFFF));
+    }
+
+    /**
+     * @return true when set has no elements
+     */
+    [[nodiscard]] bool empty() const {
+        return keys.empty();
+    }
+
+    /**
+     * @return number of elements in set
+     */
+    [[nodiscard]] size_t size() const {
+        size_t result = 0;
+        for (const auto &container : containers) result += container.cardinality;
+        return result;
+    }
+
+    /**
+     * Calls @f for every element in increasing order
+     * @param f callable taking @uint64_t
+     */
+    template<typename F>
+    void for_each(F &&f) const {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            uint64_t high = keys[i] << 16;
+            containers[i].for_each([&](uint16_t low) {
+                f(high | low);
+            });
+        }
+    }
+
+    /**
+     * Writes set to stream. Every container is written as key, type, cardinality and its own compact payload.
+     * Containers are written in their smallest representation whatever they are held in.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where set is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) keys.size();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Container converted;
+            const Container *source = &containers[i];
+            if (source->smallest_type() != source->type) {
+                converted = *source;
+                converted.optimize();
+                source = &converted;
+            }
+            const auto &container = *source;
+            out << keys[i] << (uint8_t) container.type << container.cardinality;
+            if (container.type == Container::Bitmap) {
+                out.write(container.words.data(), container.words.size() * sizeof(uint64_t));
+            } else {
+                out << (uint32_t) container.values.size();
+                out.write(container.values.data(), container.values.size() * sizeof(uint16_t));
+            }
+        }
+    }
+
+    /**
+     * Reads set from stream. Every container is validated, including its cardinality and key.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where set is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        uint64_t count;
+        in >> count;
+        keys.clear();
+        containers.clear();
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t key;
+            uint8_t type;
+            uint32_t cardinality;
+            Container container;
+            in >> key >> type >> cardinality;
+            if (key > MAX_KEY) {
+                throw std::runtime_error("Invalid roaring container key");
+            }
+            container.type = (typename Container::Type) type;
+            if (container.type == Container::Bitmap) {
+                container.words.resize(Container::BITMAP_WORDS);
+                in.read(container.words.data(), Container::BITMAP_WORDS * sizeof(uint64_t));
+            } else {
+                uint32_t values_size;
+                in >> values_size;
+                if (values_size > in.remaining() / sizeof(uint16_t)) {
+                    throw std::runtime_error("Invalid roaring container size");
+                }
+                container.values.resize(values_size);
+                in.read(container.values.data(), values_size * sizeof(uint16_t));
+            }
+            if (!container.validate() || container.cardinality != cardinality
+                || (!keys.empty() && keys.back() >= key)) {
+                throw std::runtime_error("Invalid roaring container");
+            }
+            keys.push_back(key);
+            containers.push_back(std::move(container));
+        }
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '{';
+        val.for_each([&](uint64_t elem) {
+            os << elem << ',';
+        });
+        return os << '}';
+    }
+
+    /**
+     * Converts every container to its smallest representation. Useful after many inserts.
+     */
+    void optimize() {
+        for (auto &container : containers) container.optimize();
+    }
+
+public:
+
+    // largest key, elements have 64 bits
+    static constexpr uint64_t MAX_KEY = (1ull << 48) - 1;
+
+    // high 48 bits of elements in increasing order
+    std::vector<uint64_t> keys;
+
+    // containers[i] holds low 16 bits of elements with high bits keys[i]. Never empty
+    std::vector<Container> containers;
+};
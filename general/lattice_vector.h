@@ -0,0 +1,308 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <ostream>
+#include <limits>
+
+#include "lattice.h"
+
+/**
+ * Vector of lattices indexed by process id. Used as Lattice, join and order are slotwise.
+ * The vector keeps the list of non-empty slots. Joins and serialization visit only those slots,
+ * so merging a vector where few processes contributed costs that many slot joins instead of n.
+ * Every slot change bumps the version of the vector and moves the slot to the front of a list ordered by
+ * last change, so the slots changed since a version a peer holds are found in O(changed), see @changes_since.
+ * @tparam L slot lattice
+ */
+template<Lattice L>
+class LatticeVector {
+public:
+    using Self = LatticeVector;
+
+    // largest number of slots accepted from network
+    static constexpr uint64_t MAX_SLOTS = 1ull << 20;
+
+    LatticeVector() = default;
+
+    /**
+     * @param n number of slots. All slots are bottom
+     */
+    explicit LatticeVector(size_t n) {
+        resize(n);
+    }
+
+    /**
+     * Lattice join operator.
+     * @param a first vector
+     * @param b second vector
+     * @return slotwise join of @a and @b
+     */
+    static Self join(const Self &a, const Self &b) {
+        Self result = a;
+        result.join_into(b);
+        return result;
+    }
+
+    /**
+     * Part of @value that @known does not cover. join(known, delta(value, known)) == join(known, value).
+     * @param value new value
+     * @param known value the receiver already holds
+     * @return slotwise delta. Only slots with something new are non-empty
+     */
+    static Self delta(const Self &value, const Self &known) {
+        Self result(value.size());
+        for (uint32_t k : value.present) {
+            if (k < known.size()) {
+                result.join_slot(k, L::delta(value.slots[k], known.slots[k]));
+            } else {
+                result.join_slot(k, value.slots[k]);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * In-place lattice join. Visits only non-empty slots of @other.
+     * @param other joined vector
+     * @return true when some slot grew
+     */
+    bool join_into(const Self &other) {
+        if (other.size() > size()) {
+            resize(other.size());
+        }
+        bool grew = false;
+        for (uint32_t k : other.present) {
+            grew |= join_slot(k, other.slots[k]);
+        }
+        return grew;
+    }
+
+    /**
+     * Joins @value into slot @k. Grows vector when @k is out of range.
+     * @param k slot index
+     * @param value joined value
+     * @return true when slot grew
+     */
+    bool join_slot(size_t k, const L &value) {
+        if (value.empty()) return false;
+        if (k >= size()) {
+            resize(k + 1);
+        }
+        L &slot = slots[k];
+        bool was_empty = slot.empty();
+        uint64_t old_contribution = was_empty ? 0 : contribution(k);
+        if (!slot.join_into(value)) return false;
+        if (was_empty) {
+            present.push_back((uint32_t) k);
+        }
+        hash += contribution(k) - old_contribution;
+        touch((uint32_t) k);
+        return true;
+    }
+
+    /**
+     * @return version of last slot change. Grows by one on every change, 0 while vector is bottom
+     */
+    [[nodiscard]] uint64_t version() const {
+        return clock;
+    }
+
+    /**
+     * Slots changed after @since, e.g. what a peer that joined this vector at version @since misses.
+     * join(old, changes_since(old.version())) == this when old is a former state of this vector
+     * @param since version the peer holds. 0 gives every non-empty slot
+     * @return vector of the same size holding only those slots. Costs O(changed) slot copies
+     */
+    [[nodiscard]] Self changes_since(uint64_t since) const {
+        Self result(size());
+        for (uint32_t k = newest; k != NONE && versions[k] > since; k = older[k]) {
+            result.join_slot(k, slots[k]);
+        }
+        return result;
+    }
+
+    /**
+     * Lattice less or equal operator.
+     * @param other right vector
+     * @return true when every slot is less or equal to the same slot of @other
+     */
+    bool operator<=(const Self &other) const {
+        if (present.size() > other.present.size()) return false;
+        for (uint32_t k : present) {
+            if (k >= other.size() || !(slots[k] <= other.slots[k])) return false;
+        }
+        return true;
+    }
+
+    bool operator<(const Self &other) const {
+        return *this <= other && *this != other;
+    }
+
+    /**
+     * Lattice equals operator. Number of slots does not matter, missing slots are bottom.
+     * @param other right vector
+     * @return true when all slots are equal
+     */
+    bool operator==(const Self &other) const {
+        if (hash != other.hash || present.size() != other.present.size()) return false;
+        for (uint32_t k : present) {
+            if (k >= other.size() || !(slots[k] == other.slots[k])) return false;
+        }
+        return true;
+    }
+
+    bool operator!=(const Self &other) const {
+        return !(*this == other);
+    }
+
+    const L &operator[](size_t k) const {
+        return slots[k];
+    }
+
+    /**
+     * @return number of slots
+     */
+    [[nodiscard]] size_t size() const {
+        return slots.size();
+    }
+
+    /**
+     * @return true when every slot is bottom
+     */
+    [[nodiscard]] bool empty() const {
+        return present.empty();
+    }
+
+    /**
+     * @return number of slots that are not bottom
+     */
+    [[nodiscard]] size_t count_nonempty() const {
+        return present.size();
+    }
+
+    /**
+     * Available when @L keeps a fingerprint. Updated on every slot change.
+     * @return fingerprint of all slots
+     */
+    [[nodiscard]] uint64_t fingerprint() const requires Fingerprinted<L> {
+        return hash;
+    }
+
+    /**
+     * Calls @f for every non-empty slot in order the slots became non-empty.
+     * @param f callable taking slot index and slot value
+     */
+    template<typename F>
+    void for_each_nonempty(F &&f) const {
+        for (uint32_t k : present) {
+            f((size_t) k, slots[k]);
+        }
+    }
+
+    /**
+     * Writes number of slots and every non-empty slot with its index.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param out where vector is written
+     */
+    template<typename Stream>
+    void serialize(Stream &out) const {
+        out << (uint64_t) size() << (uint64_t) present.size();
+        for (uint32_t k : present) {
+            out << k;
+            slots[k].serialize(out);
+        }
+    }
+
+    /**
+     * Reads vector written by serialize.
+     * @tparam Stream serialization stream, e.g. @net::Message
+     * @param in where vector is read from
+     */
+    template<typename Stream>
+    void deserialize(Stream &in) {
+        uint64_t n, count;
+        in >> n >> count;
+        if (n > MAX_SLOTS || count > n) {
+            throw std::runtime_error("Invalid lattice vector size: " + std::to_string(n));
+        }
+        *this = Self(n);
+        for (uint64_t i = 0; i < count; ++i) {
+            uint32_t k;
+            in >> k;
+            L value;
+            value.deserialize(in);
+            if (k >= n || !slots[k].empty() || value.empty()) {
+                throw std::runtime_error("Invalid lattice vector slot: " + std::to_string(k));
+            }
+            join_slot(k, value);
+        }
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const Self &val) {
+        os << '{';
+        for (const auto &slot : val.slots) {
+            os << slot << ',';
+        }
+        return os << '}';
+    }
+
+private:
+
+    // end of list of slots ordered by last change
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    void resize(size_t n) {
+        slots.resize(n);
+        versions.resize(n);
+        older.resize(n, NONE);
+        newer.resize(n, NONE);
+    }
+
+    /**
+     * Give slot @k the next version and move it to the front of the list ordered by last change
+     */
+    void touch(uint32_t k) {
+        if (newest == k) {
+            versions[k] = ++clock;
+            return;
+        }
+        if (versions[k] != 0) {
+            // unlink. k is not newest, so it has a newer neighbour
+            if (older[k] != NONE) newer[older[k]] = newer[k];
+            older[newer[k]] = older[k];
+        }
+        older[k] = newest;
+        newer[k] = NONE;
+        if (newest != NONE) newer[newest] = k;
+        newest = k;
+        versions[k] = ++clock;
+    }
+
+    // part of fingerprint contributed by non-empty slot @k
+    uint64_t contribution(size_t k) const {
+        if constexpr (Fingerprinted<L>) {
+            return fingerprint_mix(slots[k].fingerprint() ^ fingerprint_mix(k));
+        } else {
+            return 0;
+        }
+    }
+
+    std::vector<L> slots;
+    // indices of non-empty slots
+    std::vector<uint32_t> present;
+    // sum of contributions of non-empty slots
+    uint64_t hash = 0;
+
+    // version of last change
+    uint64_t clock = 0;
+    // version at which each slot last changed, 0 for bottom slots
+    std::vector<uint64_t> versions;
+    // slots by last change as list linked through slot indices, from @newest to oldest
+    std::vector<uint32_t> older;
+    std::vector<uint32_t> newer;
+    uint32_t newest = NONE;
+};
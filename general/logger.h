@@ -3,8 +3,7 @@
 #include <sstream>
 #include <iostream>
 #include <vector>
-
-#include "lattice.h"
+#include <atomic>
 
 /**
  * Logging level
@@ -17,9 +16,10 @@ enum LogLevel {
  * Used to log messages. Usage: LOG(INFO) << "Logging message"
  */
 struct LOG {
-    explicit LOG(LogLevel level) : level(level) {}
+    explicit LOG(LogLevel level) : level(level), enabled(level <= max_level.load(std::memory_order_relaxed)) {}
 
     ~LOG() {
+        if (!enabled) return;
         ss << '\n';
         if (level == ERROR) {
             std::cerr << ss.str();
@@ -30,14 +30,24 @@ struct LOG {
         }
     }
 
+    /**
+     * Drop messages less important than @level, e.g. INFO messages of in-process clusters
+     * @param level Least important level printed. INFO by default
+     */
+    static void set_level(LogLevel level) {
+        max_level.store(level, std::memory_order_relaxed);
+    }
+
     template<typename T>
     LOG & operator<<(const T& message) {
+        if (!enabled) return *this;
         ss << message << ' ';
         return *this;
     }
 
     template<typename T>
     LOG & operator<<(const std::vector<T> &message) {
+        if (!enabled) return *this;
         ss << '{';
         for (auto elem : message) {
             *this << elem << ',';
@@ -46,18 +56,9 @@ struct LOG {
         return *this;
     }
 
-    template<>
-    LOG & operator<<(const LatticeSet &message) {
-        ss << '{';
-        for (auto elem : message.set) {
-            ss << elem << ',';
-        }
-        ss << "} ";
-        return *this;
-    }
-
     template<typename L, typename R>
     LOG & operator<<(const std::pair<L, R> &message) {
+        if (!enabled) return *this;
         ss << '(';
         *this << message.first << message.second;
         ss << ")";
@@ -65,7 +66,10 @@ struct LOG {
     }
 
 private:
+    inline static std::atomic<LogLevel> max_level{INFO};
+
     std::stringstream ss;
     LogLevel level;
+    bool enabled;
 
 };
\ No newline at end of file
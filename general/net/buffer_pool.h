@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+namespace net {
+
+    /**
+     * Pool of byte buffers behind @Message. Free buffers are kept in power of two capacity classes,
+     * so a message of any size gets a buffer that fits it without reallocation.
+     * Buffers over 1 << MAX_CLASS bytes are freed on release, and free buffers hold at most @MAX_POOLED_BYTES,
+     * so a few large frames do not pin memory for the rest of the process.
+     * Thread safe, buffers may be released on other thread than they were acquired on.
+     */
+    struct BufferPool {
+
+        // smallest pooled capacity is 1 << MIN_CLASS bytes. Smaller buffers are not worth a lock
+        static constexpr size_t MIN_CLASS = 8;
+        // largest pooled capacity is 1 << MAX_CLASS bytes, same as connections retain for frames
+        static constexpr size_t MAX_CLASS = 20;
+        // free buffers kept in one class
+        static constexpr size_t MAX_PER_CLASS = 32;
+        // capacity of all free buffers together
+        static constexpr size_t MAX_POOLED_BYTES = 32 * 1024 * 1024;
+
+        /**
+         * Pool shared by all messages. Never destroyed, so messages may be released during exit
+         * @return global pool
+         */
+        static BufferPool &instance() {
+            static auto *pool = new BufferPool();
+            return *pool;
+        }
+
+        /**
+         * Get empty buffer
+         * @param bytes required capacity
+         * @return empty buffer with capacity of at least @bytes
+         */
+        std::vector<uint8_t> acquire(size_t bytes) {
+            size_t cls = MIN_CLASS;
+            while (cls <= MAX_CLASS && (1ull << cls) < bytes) ++cls;
+            std::vector<uint8_t> buffer;
+            if (cls <= MAX_CLASS) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto &list = free[cls - MIN_CLASS];
+                    if (!list.empty()) {
+                        buffer = std::move(list.back());
+                        list.pop_back();
+                        pooled_bytes -= buffer.capacity();
+                        return buffer;
+                    }
+                }
+                buffer.reserve(1ull << cls);
+            } else {
+                buffer.reserve(bytes);
+            }
+            return buffer;
+        }
+
+        /**
+         * Return buffer to pool. Buffers of unpooled sizes, buffers over class or byte limit are freed
+         * @param buffer released buffer
+         */
+        void release(std::vector<uint8_t> &&buffer) {
+            size_t capacity = buffer.capacity();
+            if (capacity < (1ull << MIN_CLASS) || capacity > (1ull << MAX_CLASS)) return;
+            size_t cls = MIN_CLASS;
+            while (cls < MAX_CLASS && (1ull << (cls + 1)) <= capacity) ++cls;
+            buffer.clear();
+            std::lock_guard<std::mutex> lock(mutex);
+            auto &list = free[cls - MIN_CLASS];
+            if (list.size() < MAX_PER_CLASS && pooled_bytes + capacity <= MAX_POOLED_BYTES) {
+                pooled_bytes += capacity;
+                list.push_back(std::move(buffer));
+            }
+        }
+
+    private:
+        std::mutex mutex;
+        // free[c] holds buffers with capacity of at least 1 << (c + MIN_CLASS)
+        std::array<std::vector<std::vector<uint8_t>>, MAX_CLASS - MIN_CLASS + 1> free;
+        // capacity of buffers in @free
+        size_t pooled_bytes = 0;
+    };
+}
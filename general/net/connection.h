@@ -1,31 +1,141 @@
 #pragma once
 
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
 #include "message.h"
 #include "net_async.h"
+#include "send_queue.h"
 
 namespace net {
 
+    // set in frame header when frame carries several messages
+    constexpr uint64_t BATCH_FRAME_FLAG = 1ull << 63;
+    // bits 60-62 of frame header hold @Encoding of message
+    constexpr uint64_t ENCODING_SHIFT = 60;
+    // low bits of frame header hold size
+    constexpr uint64_t FRAME_SIZE_MASK = (1ull << ENCODING_SHIFT) - 1;
+
+    /**
+     * @return frame header of @message: its size and encoding
+     */
+    inline uint64_t frame_header(const Message &message) {
+        return message.size | (uint64_t) message.encoding << ENCODING_SHIFT;
+    }
+
+    /**
+     * Parses encoding from frame header
+     * @param header frame header
+     * @param encoding where encoding is written
+     * @return false when encoding is unknown
+     */
+    inline bool frame_encoding(uint64_t header, Encoding &encoding) {
+        uint64_t value = (header & ~BATCH_FRAME_FLAG) >> ENCODING_SHIFT;
+        if (value > (uint64_t) MAX_ENCODING) return false;
+        encoding = (Encoding) value;
+        return true;
+    }
+
+    /**
+     * Send side message coalescing. Messages queued for the same peer are packed into one batched frame.
+     */
+    struct CoalescingOptions {
+        // how long first queued message waits for others. 0 batches only messages queued during a write
+        std::chrono::microseconds flush_window{0};
+        // batch is flushed once it holds this many bytes
+        uint64_t max_batch_bytes = 64 * 1024;
+    };
+
+    // message buffers larger than this are released after dispatch instead of reused
+    constexpr uint64_t MAX_RETAINED_MESSAGE = 1024 * 1024;
+    // so released buffers are freed, not kept by the pool
+    static_assert(MAX_RETAINED_MESSAGE == 1ull << BufferPool::MAX_CLASS);
+
     /**
-     * Reads message from socket.
+     * Passes messages of received frame to callback. Batched frame is split into messages first.
+     * Buffers larger than @MAX_RETAINED_MESSAGE are released afterwards.
+     * @param frame received frame
+     * @param inner message reused for messages of batched frame
+     * @param batch frame is batched
+     * @param callback message received callback
+     */
+    inline void dispatch_frame(Message &frame, Message &inner, bool batch, IMessageReceivedCallback *callback) {
+        if (!batch) {
+            callback->on_message_received(frame);
+        }
+        while (batch && frame.remaining() > 0) {
+            uint64_t header;
+            if (frame.remaining() < sizeof(header)) {
+                LOG(ERROR) << "Invalid batched frame";
+                break;
+            }
+            frame.read(&header, sizeof(header));
+            inner.size = header & FRAME_SIZE_MASK;
+            if ((header & BATCH_FRAME_FLAG) || !frame_encoding(header, inner.encoding)
+                || inner.size > frame.remaining()) {
+                LOG(ERROR) << "Invalid batched frame";
+                break;
+            }
+            inner.cur_pos = 0;
+            inner.data.clear();
+            inner.reserve(inner.size);
+            inner.data.resize(inner.size);
+            frame.read(inner.data.data(), inner.size);
+            callback->on_message_received(inner);
+        }
+        if (frame.data.capacity() > MAX_RETAINED_MESSAGE) {
+            frame = Message();
+        }
+        if (inner.data.capacity() > MAX_RETAINED_MESSAGE) {
+            inner = Message();
+        }
+    }
+
+    /**
+     * Reads framed messages from socket until peer closes it.
+     * Frame is header followed by message data. Header is message size with @Encoding in bits 60-62.
+     * Batched frame has @BATCH_FRAME_FLAG in header and holds several messages, each with its own header.
+     * Socket is read in chunks into a reused buffer, so one read may yield several small frames.
+     * Body of a frame larger than what is buffered is read directly into the message.
+     * Frames larger than @max_frame_size close the connection.
+     * Buffers come from @BufferPool and return there when connection finishes.
      */
     struct ReadConnection : std::enable_shared_from_this<ReadConnection> {
 
+        // size of buffer socket is read into
+        static constexpr uint64_t READ_BUFFER_SIZE = 64 * 1024;
+        // default limit of one frame
+        static constexpr uint64_t DEFAULT_MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
         /**
          * ReadConnection constructor
          * @param context context where async calls will be executed
          * @param socket client socket
          * @param callback message received callback
+         * @param max_frame_size largest accepted frame in bytes
          */
-        ReadConnection(asio::io_context &context, asio::ip::tcp::socket socket, IMessageReceivedCallback *callback)
+        ReadConnection(asio::io_context &context, asio::ip::tcp::socket socket, IMessageReceivedCallback *callback,
+                       uint64_t max_frame_size = DEFAULT_MAX_FRAME_SIZE)
                 : context(context),
                   socket(std::move(socket)),
-                  callback(callback) {}
+                  callback(callback),
+                  max_frame_size(max_frame_size),
+                  buffer(BufferPool::instance().acquire(READ_BUFFER_SIZE)) {
+            buffer.resize(READ_BUFFER_SIZE);
+        }
+
+        ~ReadConnection() {
+            BufferPool::instance().release(std::move(buffer));
+        }
 
         /**
          * Start async task
          */
         void receive() {
-            read_header(shared_from_this());
+            read_some(shared_from_this());
         }
 
     private:
@@ -33,96 +143,338 @@ namespace net {
         asio::ip::tcp::socket socket;
 
         IMessageReceivedCallback *callback;
+        uint64_t max_frame_size;
+
+        // bytes read from socket. [begin, end) are not parsed yet
+        std::vector<uint8_t> buffer;
+        size_t begin = 0;
+        size_t end = 0;
 
+        // message passed to callback. Its data is reused between frames
         Message message;
+        // message split from batched frame
+        Message inner;
 
-        static void read_header(std::shared_ptr<ReadConnection> self) {
-            asio::async_read(self->socket, asio::buffer(&self->message.size, sizeof(self->message.size)),
-                [&, self](std::error_code er, size_t len) {
+        static void read_some(std::shared_ptr<ReadConnection> self) {
+            // only part of a header can be left here
+            if (self->begin > 0) {
+                std::memmove(self->buffer.data(), self->buffer.data() + self->begin, self->end - self->begin);
+                self->end -= self->begin;
+                self->begin = 0;
+            }
+            self->socket.async_read_some(
+                asio::buffer(self->buffer.data() + self->end, self->buffer.size() - self->end),
+                [self](const asio::error_code &er, size_t len) {
                     if (!er) {
-                        self->message.data.resize(self->message.size);
-                        read_data(self);
+                        self->end += len;
+                        parse(self);
                     } else {
-                        LOG(ERROR) << "Error reading header:" << er.message();
+                        if (er != asio::error::eof) {
+                            LOG(ERROR) << "Error reading frame:" << er.message();
+                        }
                         self->socket.close();
                     }
                 });
         }
 
-        static void read_data(std::shared_ptr<ReadConnection> self) {
-            asio::async_read(self->socket, asio::buffer(self->message.data.data(), self->message.size),
-                [&, self](std::error_code er, size_t len) {
+        /**
+         * Dispatches every complete frame in buffer. Starts direct read of body when frame is not complete
+         */
+        static void parse(const std::shared_ptr<ReadConnection> &self) {
+            while (self->end - self->begin >= sizeof(uint64_t)) {
+                uint64_t header;
+                std::memcpy(&header, self->buffer.data() + self->begin, sizeof(header));
+                bool batch = header & BATCH_FRAME_FLAG;
+                uint64_t size = header & FRAME_SIZE_MASK;
+                Encoding encoding;
+                if (!frame_encoding(header, encoding)) {
+                    LOG(ERROR) << "Unknown frame encoding in header" << header;
+                    self->socket.close();
+                    return;
+                }
+                if (size > self->max_frame_size) {
+                    LOG(ERROR) << "Frame of" << size << "bytes exceeds limit" << self->max_frame_size;
                     self->socket.close();
+                    return;
+                }
+                self->begin += sizeof(header);
+
+                Message &message = self->message;
+                message.cur_pos = 0;
+                message.size = size;
+                message.encoding = encoding;
+                message.data.clear();
+                message.reserve(size);
+                message.data.resize(size);
+                uint64_t available = std::min<uint64_t>(size, self->end - self->begin);
+                if (available > 0) {
+                    std::memcpy(message.data.data(), self->buffer.data() + self->begin, available);
+                }
+                self->begin += available;
+                if (available < size) {
+                    read_body(self, available, batch);
+                    return;
+                }
+                dispatch(self, batch);
+            }
+            read_some(self);
+        }
+
+        /**
+         * Reads rest of frame body directly into message
+         * @param offset bytes of body already copied from buffer
+         * @param batch frame is batched
+         */
+        static void read_body(std::shared_ptr<ReadConnection> self, uint64_t offset, bool batch) {
+            asio::async_read(self->socket,
+                asio::buffer(self->message.data.data() + offset, self->message.size - offset),
+                [self, batch](const asio::error_code &er, size_t) {
                     if (!er) {
-                        self->callback->on_message_received(self->message);
+                        dispatch(self, batch);
+                        read_some(self);
                     } else {
                         LOG(ERROR) << "Error reading data:" << er.message();
+                        self->socket.close();
                     }
                 });
         }
+
+        static void dispatch(const std::shared_ptr<ReadConnection> &self, bool batch) {
+            dispatch_frame(self->message, self->inner, batch, self->callback);
+        }
     };
 
+    /**
+     * Persistent connection to one peer. Messages are queued and written one frame after another over the same socket.
+     * Queue holds @SharedMessage, so connections that send the same broadcast share its buffer.
+     * Queue is a bounded @SendQueue: full queue rejects, drops or blocks by @SendQueueOptions.
+     * Several queued messages are coalesced into one batched frame according to @CoalescingOptions.
+     * Socket is opened on first message and reopened after failure. When peer stays unreachable
+     * for @MAX_CONNECT_ATTEMPTS attempts queued messages are dropped.
+     * Apart from the queue all members are used only from the connection strand, so connections to different peers
+     * run in parallel on the context threads while one connection never runs on two threads at once.
+     */
     struct WriteConnection : std::enable_shared_from_this<WriteConnection> {
 
+        // connection attempts before queued messages are dropped
+        static constexpr uint64_t MAX_CONNECT_ATTEMPTS = 5;
+        // delay before first reconnect. Doubles after every failed attempt
+        static constexpr uint64_t RECONNECT_DELAY_MS = 50;
+
+        using Strand = asio::strand<asio::io_context::executor_type>;
+
+        WriteConnection(asio::io_context &context, ProcessDescriptor descriptor, CoalescingOptions options = {},
+                        SendQueueOptions queue_options = {})
+                : context(context),
+                  strand(asio::make_strand(context)),
+                  socket(strand),
+                  reconnect_timer(strand),
+                  flush_timer(strand),
+                  descriptor(std::move(descriptor)),
+                  options(options),
+                  queue(queue_options) {}
+
+        /**
+         * @return strand that runs every operation of this connection
+         */
+        const Strand &get_executor() const {
+            return strand;
+        }
+
+        /**
+         * @return peer of this connection
+         */
+        const ProcessDescriptor &get_descriptor() const {
+            return descriptor;
+        }
+
+        /**
+         * Queue message. Thread safe. Connection strand is woken at most once for messages queued together
+         * @param message Message that will be sent. Written directly from shared buffer
+         * @param key Message replaces queued message with the same key, see @SendQueue
+         * @return false when queue rejected message
+         */
+        bool send(SharedMessage message, uint64_t key = SendQueue::NO_KEY) {
+            // context threads write the queue, only other threads may wait for room
+            bool may_block = !context.get_executor().running_in_this_thread();
+            if (!queue.push(std::move(message), key, may_block)) return false;
+            if (!kick_pending.exchange(true)) {
+                asio::post(strand, [self = shared_from_this()]() {
+                    self->kick_pending = false;
+                    if (self->state == Connected && !self->writing) {
+                        schedule_flush(self);
+                    } else if (self->state == Disconnected) {
+                        connect(self);
+                    }
+                });
+            }
+            return true;
+        }
+
+        /**
+         * @return counters of queue
+         */
+        SendQueueStats stats() const {
+            return queue.get_stats();
+        }
+
+        /**
+         * Close socket and drop queued messages. Messages sent afterwards are rejected
+         */
+        void close() {
+            reconnect_timer.cancel();
+            flush_timer.cancel();
+            socket.close();
+            queue.drop(batch);
+            queue.close();
+            state = Disconnected;
+        }
+
+    private:
+        enum State {
+            Disconnected,
+            Connecting,
+            Connected
+        };
+
         asio::io_context &context;
+        Strand strand;
         asio::ip::tcp::socket socket;
-        Message message;
+        asio::steady_timer reconnect_timer;
+        asio::steady_timer flush_timer;
         ProcessDescriptor descriptor;
-        asio::steady_timer timer;
-
-        WriteConnection(asio::io_context &context, ProcessDescriptor descriptor, Message message)
-                : message(std::move(message)),
-                  context(context),
-                  socket(context),
-                  timer(context),
-                  descriptor(std::move(descriptor)) {}
-
-        void send() {
-            auto ptr = shared_from_this();
-            timer.async_wait([ptr](const asio::error_code& er) {
-                if (!er) {
-                    connect(ptr);
-                } else {
-                    LOG(ERROR) << "ERROR Waiting" << er.message();
+        CoalescingOptions options;
+
+        SendQueue queue;
+        // messages taken from queue for frame being written. Kept until written, resent after reconnect
+        std::vector<SharedMessage> batch;
+        // wake up of strand is posted and did not run yet
+        std::atomic<bool> kick_pending = false;
+        State state = Disconnected;
+        bool writing = false;
+        bool flush_scheduled = false;
+        uint64_t failed_attempts = 0;
+
+        // headers of frame being written. First is header of batched frame, then header of every message
+        std::vector<uint64_t> headers;
+        std::vector<asio::const_buffer> buffers;
+
+        /**
+         * Write queued messages now when batch is full or no flush window is set, otherwise after flush window
+         */
+        static void schedule_flush(std::shared_ptr<WriteConnection> self) {
+            if (self->options.flush_window.count() == 0 || self->queue.queued_bytes() >= self->options.max_batch_bytes) {
+                if (self->flush_scheduled) {
+                    self->flush_scheduled = false;
+                    self->flush_timer.cancel();
+                }
+                write_next(self);
+                return;
+            }
+            if (self->flush_scheduled) return;
+            self->flush_scheduled = true;
+            self->flush_timer.expires_from_now(self->options.flush_window);
+            self->flush_timer.async_wait([self](const asio::error_code &er) {
+                if (!er && self->flush_scheduled) {
+                    self->flush_scheduled = false;
+                    if (!self->writing) {
+                        write_next(self);
+                    }
                 }
             });
         }
 
-    private:
         static void connect(std::shared_ptr<WriteConnection> self) {
+            self->state = Connecting;
             asio::ip::tcp::resolver resolver(self->context);
-            asio::ip::tcp::resolver::results_type endpoints
-                    = resolver.resolve(self->descriptor.ip_address, std::to_string(self->descriptor.port));
-            asio::async_connect(self->socket, endpoints, [&, self](std::error_code er, const asio::ip::tcp::endpoint &endpoint) {
+            asio::error_code resolve_error;
+            auto endpoints = resolver.resolve(self->descriptor.ip_address, std::to_string(self->descriptor.port),
+                                              resolve_error);
+            if (resolve_error) {
+                LOG(ERROR) << "Unable to resolve:" << resolve_error.message();
+                on_failure(self);
+                return;
+            }
+            asio::async_connect(self->socket, endpoints, [self](std::error_code er, const asio::ip::tcp::endpoint &) {
                 if (!er) {
-                    write_header(self);
+                    self->state = Connected;
+                    self->failed_attempts = 0;
+                    self->socket.set_option(asio::ip::tcp::no_delay(true));
+                    write_next(self);
                 } else {
                     LOG(ERROR) << "Unable to connect:" << er.message();
-                    self->socket.close();
+                    on_failure(self);
                 }
             });
         }
 
-        static void write_header(std::shared_ptr<WriteConnection> self) {
-            asio::async_write(self->socket, asio::buffer(&self->message.size, sizeof(self->message.size)),
-                [&, self](std::error_code er, size_t len) {
-                    if (!er) {
-                        write_data(self);
-                    } else {
-                        LOG(ERROR) << "Error writing header:" << er.message();
-                        self->socket.close();
-                    }
-                });
+        static void write_next(std::shared_ptr<WriteConnection> self) {
+            if (self->state != Connected) {
+                self->writing = false;
+                return;
+            }
+            // batch left by failed write goes first
+            if (self->batch.empty()) {
+                self->queue.take(self->batch, self->options.max_batch_bytes);
+            }
+            if (self->batch.empty()) {
+                self->writing = false;
+                return;
+            }
+            self->writing = true;
+            uint64_t batch_bytes = 0;
+            for (const auto &message : self->batch) {
+                batch_bytes += sizeof(uint64_t) + message->size;
+            }
+            // buffers point into headers, so it is sized before they are taken
+            self->headers.resize(self->batch.size() + 1);
+            self->buffers.clear();
+            if (self->batch.size() > 1) {
+                // batch payload keeps header of every message
+                self->headers[0] = BATCH_FRAME_FLAG | batch_bytes;
+                self->buffers.push_back(asio::buffer(&self->headers[0], sizeof(uint64_t)));
+            }
+            for (size_t i = 0; i < self->batch.size(); ++i) {
+                const Message &message = *self->batch[i];
+                self->headers[i + 1] = frame_header(message);
+                self->buffers.push_back(asio::buffer(&self->headers[i + 1], sizeof(uint64_t)));
+                self->buffers.push_back(asio::buffer(message.data.data(), message.size));
+            }
+            asio::async_write(self->socket, self->buffers, [self](std::error_code er, size_t) {
+                if (!er) {
+                    self->queue.complete(self->batch);
+                    self->batch.clear();
+                    write_next(self);
+                } else {
+                    LOG(ERROR) << "Error writing message:" << er.message();
+                    self->writing = false;
+                    on_failure(self);
+                }
+            });
         }
 
-        static void write_data(std::shared_ptr<WriteConnection> self) {
-            asio::async_write(self->socket, asio::buffer(self->message.data.data(), self->message.size),
-                [&, self](std::error_code er, size_t len) {
-                    if (er) {
-                        LOG(ERROR) << "Error writing data:" << er.message();
-                    }
-                    self->socket.close();
-                });
+        /**
+         * Close socket and reconnect later. Messages being written stay in batch and are sent again.
+         */
+        static void on_failure(std::shared_ptr<WriteConnection> self) {
+            asio::error_code ignored;
+            self->socket.close(ignored);
+            self->state = Disconnected;
+            if (++self->failed_attempts >= MAX_CONNECT_ATTEMPTS) {
+                uint64_t dropped = self->queue.drop(self->batch);
+                LOG(ERROR) << "Peer" << self->descriptor.id << "unreachable. Dropped" << dropped << "messages";
+                self->failed_attempts = 0;
+                return;
+            }
+            if (self->batch.empty() && self->queue.empty()) return;
+            self->state = Connecting;
+            uint64_t delay = RECONNECT_DELAY_MS << (self->failed_attempts - 1);
+            self->reconnect_timer.expires_from_now(std::chrono::milliseconds(delay));
+            self->reconnect_timer.async_wait([self](const asio::error_code &er) {
+                if (!er) {
+                    connect(self);
+                }
+            });
         }
     };
-}
\ No newline at end of file
+}
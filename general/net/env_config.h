@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdlib>
+#include <chrono>
+#include <string>
+
+#include "server.h"
+
+namespace net {
+
+    /**
+     * Configure @server from LA_* environment variables described in README: LA_LINK_MODEL, LA_FLUSH_WINDOW_US,
+     * LA_IO_THREADS, LA_TRANSPORT, LA_MULTICAST and LA_SEND_QUEUE. Unset variables keep server defaults.
+     * Invalid values throw.
+     * @param server server to configure, before it is started
+     * @param id id of this process
+     * @param n number of processes
+     * @return mask of message types sent in compact encoding, from LA_COMPACT_TYPES. 0 when unset
+     */
+    inline uint32_t configure_from_env(Server &server, uint64_t id, uint64_t n) {
+        if (const char *link_model = std::getenv("LA_LINK_MODEL")) {
+            server.set_link_model(EmulatedLink::load(link_model, id));
+        }
+        if (const char *flush_window = std::getenv("LA_FLUSH_WINDOW_US")) {
+            server.set_coalescing({std::chrono::microseconds(std::stoull(flush_window))});
+        }
+        if (const char *io_threads = std::getenv("LA_IO_THREADS")) {
+            server.set_io_threads(std::stoull(io_threads));
+        }
+        if (const char *transport = std::getenv("LA_TRANSPORT")) {
+            server.set_transport(parse_transport(transport));
+        }
+        if (const char *multicast = std::getenv("LA_MULTICAST")) {
+            server.set_multicast(MulticastOptions::parse(multicast, id, n));
+        }
+        if (const char *send_queue = std::getenv("LA_SEND_QUEUE")) {
+            server.set_send_queue(SendQueueOptions::parse(send_queue));
+        }
+        uint32_t compact_types = 0;
+        if (const char *value = std::getenv("LA_COMPACT_TYPES")) {
+            compact_types = std::stoul(value, nullptr, 0);
+        }
+        return compact_types;
+    }
+
+    /**
+     * Log send queue statistics of @server merged over all peers
+     * @param server server whose queues are logged
+     */
+    inline void log_send_queue_stats(Server &server) {
+        SendQueueStats queues;
+        for (const auto &peer : server.send_queue_stats()) {
+            queues.merge(peer.second);
+        }
+        LOG(INFO) << "Send queues. peak messages:" << queues.max_messages << "bytes:" << queues.max_bytes
+                  << "coalesced:" << queues.coalesced << "rejected:" << queues.rejected
+                  << "dropped:" << queues.dropped;
+    }
+}
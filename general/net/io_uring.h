@@ -0,0 +1,273 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <string>
+
+#include "../logger.h"
+
+namespace net {
+
+    /**
+     * Minimal io_uring on raw system calls. Submission and completion queues are shared with kernel,
+     * so any number of operations is submitted and every finished one reaped with one io_uring_enter.
+     * Not thread safe, used from one thread.
+     */
+    struct IoUring {
+
+        /**
+         * @param entries submission queue size. Completion queue is four times larger, since multishot operations
+         * post many completions per submission
+         */
+        explicit IoUring(unsigned entries) {
+            io_uring_params params{};
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+            params.cq_entries = entries * 4;
+            fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+            if (fd < 0 && errno == EINVAL) {
+                // kernel without cooperative task running
+                params = {};
+                params.flags = IORING_SETUP_CQSIZE;
+                params.cq_entries = entries * 4;
+                fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+            }
+            if (fd < 0) {
+                fail("io_uring_setup");
+            }
+
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+            }
+            sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+            cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe *) map(sqes_size, IORING_OFF_SQES);
+
+            auto *sq = (uint8_t *) sq_ring;
+            sq_head = (unsigned *) (sq + params.sq_off.head);
+            sq_tail = (unsigned *) (sq + params.sq_off.tail);
+            sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+            sq_entries = params.sq_entries;
+            sq_array = (unsigned *) (sq + params.sq_off.array);
+            auto *cq = (uint8_t *) cq_ring;
+            cq_head = (unsigned *) (cq + params.cq_off.head);
+            cq_tail = (unsigned *) (cq + params.cq_off.tail);
+            cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+            tail = *sq_tail;
+        }
+
+        IoUring(const IoUring &) = delete;
+
+        IoUring &operator=(const IoUring &) = delete;
+
+        ~IoUring() {
+            munmap(sqes, sqes_size);
+            if (cq_ring != sq_ring) {
+                munmap(cq_ring, cq_ring_size);
+            }
+            munmap(sq_ring, sq_ring_size);
+            close(fd);
+        }
+
+        /**
+         * Next free submission entry. Queued entries are submitted first when queue is full
+         * @return zeroed entry, submitted on next submit
+         */
+        io_uring_sqe *get_sqe() {
+            if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                submit(0);
+            }
+            unsigned index = tail & sq_mask;
+            io_uring_sqe *sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sq_array[index] = index;
+            ++tail;
+            return sqe;
+        }
+
+        /**
+         * Submit queued entries and wait for completions
+         * @param wait number of completions to wait for
+         */
+        void submit(unsigned wait) {
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            // entries kernel did not consume yet, including ones left by a busy enter
+            unsigned pending = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (pending == 0 && wait == 0) return;
+            unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+            while (syscall(__NR_io_uring_enter, fd, pending, wait, flags, nullptr, 0) < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EBUSY) return;
+                fail("io_uring_enter");
+            }
+        }
+
+        /**
+         * Pass every available completion to @f and release them
+         * @param f callable taking const io_uring_cqe &
+         * @return number of completions
+         */
+        template<typename F>
+        unsigned reap(F &&f) {
+            unsigned head = *cq_head;
+            unsigned count = 0;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe cqe = cqes[head & cq_mask];
+                // completion slot is released before handling, so handler may submit and reap again
+                __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+                f(cqe);
+                ++count;
+                head = *cq_head;
+            }
+            return count;
+        }
+
+        /**
+         * Register memory with ring
+         * @param opcode IORING_REGISTER_* operation
+         * @param arg operation argument
+         * @param count number of arguments
+         */
+        void register_with(unsigned opcode, void *arg, unsigned count) {
+            if (syscall(__NR_io_uring_register, fd, opcode, arg, count) < 0) {
+                fail("io_uring_register");
+            }
+        }
+
+    private:
+        int fd = -1;
+        void *sq_ring = nullptr;
+        void *cq_ring = nullptr;
+        size_t sq_ring_size = 0;
+        size_t cq_ring_size = 0;
+        io_uring_sqe *sqes = nullptr;
+        size_t sqes_size = 0;
+
+        unsigned *sq_head = nullptr;
+        unsigned *sq_tail = nullptr;
+        unsigned *sq_array = nullptr;
+        unsigned sq_mask = 0;
+        unsigned sq_entries = 0;
+        // tail including entries not yet published to kernel
+        unsigned tail = 0;
+
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        io_uring_cqe *cqes = nullptr;
+
+        void *map(size_t size, uint64_t offset) {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t) offset);
+            if (ptr == MAP_FAILED) {
+                fail("mmap");
+            }
+            return ptr;
+        }
+
+        static void fail(const std::string &call) {
+            std::string error = call + " failed: " + std::strerror(errno);
+            LOG(ERROR) << error;
+            throw std::runtime_error(error);
+        }
+    };
+
+    /**
+     * Receive buffers provided to ring as one buffer group. Multishot receives pick a free buffer
+     * for every completion, and buffer is given back to kernel after its data is parsed.
+     * Buffers are listed in a buffer ring registered with the ring (IORING_REGISTER_PBUF_RING), so giving them
+     * back is a store to memory shared with kernel, without a submission or completion per buffer.
+     * Registration ends with the ring, which should be destroyed first.
+     */
+    struct ProvidedBuffers {
+
+        /**
+         * @param ring ring buffers are registered with
+         * @param group buffer group id used by receives
+         * @param count number of buffers. Power of two, at most 32768
+         * @param size size of one buffer
+         */
+        ProvidedBuffers(IoUring &ring, uint16_t group, unsigned count, unsigned size)
+                : size(size), mask(count - 1), memory((size_t) count * size) {
+            ring_size = (size_t) count * sizeof(io_uring_buf);
+            void *ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ptr == MAP_FAILED) {
+                std::string error = std::string("mmap failed: ") + std::strerror(errno);
+                LOG(ERROR) << error;
+                throw std::runtime_error(error);
+            }
+            entries = (io_uring_buf_ring *) ptr;
+            io_uring_buf_reg reg{};
+            reg.ring_addr = (uint64_t) entries;
+            reg.ring_entries = count;
+            reg.bgid = group;
+            try {
+                ring.register_with(IORING_REGISTER_PBUF_RING, &reg, 1);
+            } catch (const std::runtime_error &) {
+                munmap(entries, ring_size);
+                throw;
+            }
+            for (unsigned id = 0; id < count; ++id) {
+                add((uint16_t) id);
+            }
+            publish();
+        }
+
+        ProvidedBuffers(const ProvidedBuffers &) = delete;
+
+        ProvidedBuffers &operator=(const ProvidedBuffers &) = delete;
+
+        ~ProvidedBuffers() {
+            munmap(entries, ring_size);
+        }
+
+        /**
+         * @return memory of buffer @id
+         */
+        const uint8_t *buffer(uint16_t id) const {
+            return memory.data() + (size_t) id * size;
+        }
+
+        /**
+         * Give buffer back to kernel. Visible to kernel after next publish
+         */
+        void add(uint16_t id) {
+            // fields are set one by one, resv of the first entry holds ring tail. Ring is indexed as plain array,
+            // in C++ the flexible bufs member of io_uring_buf_ring does not start at offset 0
+            io_uring_buf &entry = ((io_uring_buf *) entries)[tail & mask];
+            entry.addr = (uint64_t) buffer(id);
+            entry.len = size;
+            entry.bid = id;
+            ++tail;
+        }
+
+        /**
+         * Make added buffers visible to kernel
+         */
+        void publish() {
+            __atomic_store_n(&entries->tail, tail, __ATOMIC_RELEASE);
+        }
+
+    private:
+        unsigned size;
+        unsigned mask;
+        std::vector<uint8_t> memory;
+        // buffer ring shared with kernel
+        io_uring_buf_ring *entries = nullptr;
+        size_t ring_size = 0;
+        // tail including buffers not yet published
+        uint16_t tail = 0;
+    };
+}
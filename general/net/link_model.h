@@ -0,0 +1,289 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "net_async.h"
+#include "../logger.h"
+
+namespace net {
+
+    /**
+     * What happens to one message on its way to peer.
+     */
+    struct LinkDecision {
+        // message is lost
+        bool drop = false;
+        // time before message is handed to the connection
+        std::chrono::microseconds delay{0};
+    };
+
+    /**
+     * Network emulation used by @Server before sending every message.
+     */
+    struct ILinkModel {
+        /**
+         * Called for every message sent by @Server. Calls are serialized by @Server.
+         * @param to receiver
+         * @param bytes message size
+         * @return whether message is dropped and how long it is delayed
+         */
+        virtual LinkDecision on_send(const ProcessDescriptor &to, uint64_t bytes) = 0;
+
+        virtual ~ILinkModel() = default;
+    };
+
+    /**
+     * Default link model. Sends every message immediately.
+     */
+    struct ZeroDelayLink : ILinkModel {
+        LinkDecision on_send(const ProcessDescriptor &, uint64_t) override {
+            return {};
+        }
+    };
+
+    /**
+     * Parameters of one directed link.
+     */
+    struct LinkParams {
+        enum Distribution {
+            Normal,
+            Uniform,
+            Exponential
+        };
+
+        // base one way latency
+        double latency_ms = 0;
+        // standard deviation for Normal, half width for Uniform, mean for Exponential
+        double jitter_ms = 0;
+        Distribution distribution = Normal;
+        // probability that message is lost
+        double loss = 0;
+        // probability that message is held back by @reorder_ms so later messages overtake it
+        double reorder = 0;
+        double reorder_ms = 0;
+        // link capacity. 0 means unlimited
+        double bandwidth_bytes_per_sec = 0;
+        // every message is lost
+        bool partitioned = false;
+    };
+
+    /**
+     * Link model with latency, loss, reordering, bandwidth caps and partitions configured per pair of processes.
+     * Configuration file has one rule per line. A rule starts from the parameters its pair had before,
+     * and the most specific rule wins: exact pair, then sender, then receiver, then "* *":
+     *     <from|*> <to|*> [latency=MS] [jitter=MS] [distribution=normal|uniform|exponential] [loss=P]
+     *                     [reorder=P] [reorder_delay=MS] [bandwidth=BYTES_PER_SEC] [partitioned=0|1]
+     *     partition <id,id,...> <id,id,...>
+     * Lines starting with '#' are comments. E.g. "* * latency=300 jitter=30" gives the WAN delay used in experiments.
+     */
+    struct EmulatedLink : ILinkModel {
+
+        /**
+         * @param self id of sending process
+         * @param seed random seed. Taken from random device when 0
+         */
+        explicit EmulatedLink(uint64_t self, uint64_t seed = 0)
+                : self(self), generator(seed ? seed : std::random_device{}()) {}
+
+        /**
+         * Load rules from file
+         * @param path configuration file
+         * @param self id of sending process
+         * @param seed random seed. Taken from random device when 0
+         * @return configured link model
+         */
+        static std::unique_ptr<EmulatedLink> load(const std::string &path, uint64_t self, uint64_t seed = 0) {
+            std::ifstream in(path);
+            if (!in) {
+                LOG(ERROR) << "Unable to open link model" << path;
+                throw std::runtime_error("Unable to open link model " + path);
+            }
+            auto model = std::make_unique<EmulatedLink>(self, seed);
+            std::string line;
+            while (std::getline(in, line)) {
+                model->parse_rule(line);
+            }
+            return model;
+        }
+
+        /**
+         * Set parameters for messages from @from to @to. ANY matches every process.
+         */
+        void set(uint64_t from, uint64_t to, const LinkParams &params) {
+            rules[{from, to}] = params;
+        }
+
+        /**
+         * Replace clock that bandwidth caps are measured with, e.g. by virtual time of a simulation
+         * @param value Callable returning current time point
+         */
+        void set_clock(std::function<std::chrono::steady_clock::time_point()> value) {
+            clock = std::move(value);
+        }
+
+        /**
+         * Cut every link between @a and @b in both directions.
+         */
+        void partition(const std::set<uint64_t> &a, const std::set<uint64_t> &b) {
+            for (uint64_t x : a) {
+                for (uint64_t y : b) {
+                    params_for(x, y).partitioned = true;
+                    params_for(y, x).partitioned = true;
+                }
+            }
+        }
+
+        /**
+         * Restore every partitioned link.
+         */
+        void heal() {
+            for (auto &rule : rules) {
+                rule.second.partitioned = false;
+            }
+        }
+
+        LinkDecision on_send(const ProcessDescriptor &to, uint64_t bytes) override {
+            const LinkParams &params = lookup(self, to.id);
+            LinkDecision decision;
+            if (params.partitioned || (params.loss > 0 && uniform(generator) < params.loss)) {
+                decision.drop = true;
+                return decision;
+            }
+
+            double delay_ms = params.latency_ms + jitter(params);
+            if (params.reorder > 0 && uniform(generator) < params.reorder) {
+                delay_ms += params.reorder_ms;
+            }
+            if (params.bandwidth_bytes_per_sec > 0) {
+                auto now = clock();
+                auto &busy = busy_until[to.id];
+                if (busy < now) busy = now;
+                busy += std::chrono::microseconds((uint64_t)((double)bytes * 1e6 / params.bandwidth_bytes_per_sec));
+                delay_ms += (double)std::chrono::duration_cast<std::chrono::microseconds>(busy - now).count() / 1e3;
+            }
+            decision.delay = std::chrono::microseconds((uint64_t)std::max(0., delay_ms * 1e3));
+            return decision;
+        }
+
+        // matches every process in rules
+        static constexpr uint64_t ANY = UINT64_MAX;
+
+    private:
+        uint64_t self;
+        std::map<std::pair<uint64_t, uint64_t>, LinkParams> rules;
+        std::map<uint64_t, std::chrono::steady_clock::time_point> busy_until;
+        std::mt19937_64 generator;
+        std::uniform_real_distribution<double> uniform{0, 1};
+        std::function<std::chrono::steady_clock::time_point()> clock = std::chrono::steady_clock::now;
+
+        // most specific rule wins: exact pair, then from, then to, then default
+        const LinkParams &lookup(uint64_t from, uint64_t to) const {
+            for (auto key : {std::pair{from, to}, std::pair{from, ANY}, std::pair{ANY, to}, std::pair{ANY, ANY}}) {
+                auto it = rules.find(key);
+                if (it != rules.end()) return it->second;
+            }
+            static const LinkParams zero;
+            return zero;
+        }
+
+        // rule for exact pair, created from currently matching rule
+        LinkParams &params_for(uint64_t from, uint64_t to) {
+            auto it = rules.find({from, to});
+            if (it == rules.end()) {
+                it = rules.emplace(std::pair{from, to}, lookup(from, to)).first;
+            }
+            return it->second;
+        }
+
+        double jitter(const LinkParams &params) {
+            if (params.jitter_ms <= 0) return 0;
+            switch (params.distribution) {
+                case LinkParams::Normal:
+                    return std::normal_distribution<double>{0, params.jitter_ms}(generator);
+                case LinkParams::Uniform:
+                    return std::uniform_real_distribution<double>{-params.jitter_ms, params.jitter_ms}(generator);
+                case LinkParams::Exponential:
+                    return std::exponential_distribution<double>{1. / params.jitter_ms}(generator);
+            }
+            return 0;
+        }
+
+        static uint64_t parse_id(const std::string &token) {
+            return token == "*" ? ANY : std::stoull(token);
+        }
+
+        static std::set<uint64_t> parse_ids(const std::string &token) {
+            std::set<uint64_t> ids;
+            std::stringstream ss(token);
+            std::string id;
+            while (std::getline(ss, id, ',')) {
+                ids.insert(std::stoull(id));
+            }
+            return ids;
+        }
+
+        void parse_rule(const std::string &line) {
+            std::stringstream ss(line);
+            std::string first, second;
+            if (!(ss >> first) || first[0] == '#') return;
+            if (!(ss >> second)) {
+                LOG(ERROR) << "Invalid link rule:" << line;
+                throw std::runtime_error("Invalid link rule: " + line);
+            }
+            if (first == "partition") {
+                std::string other;
+                ss >> other;
+                partition(parse_ids(second), parse_ids(other));
+                return;
+            }
+            uint64_t from = parse_id(first), to = parse_id(second);
+            LinkParams &params = params_for(from, to);
+            std::string option;
+            while (ss >> option) {
+                auto eq = option.find('=');
+                if (eq == std::string::npos) {
+                    LOG(ERROR) << "Invalid link option:" << option;
+                    throw std::runtime_error("Invalid link option: " + option);
+                }
+                std::string key = option.substr(0, eq), value = option.substr(eq + 1);
+                if (key == "latency") {
+                    params.latency_ms = std::stod(value);
+                } else if (key == "jitter") {
+                    params.jitter_ms = std::stod(value);
+                } else if (key == "distribution") {
+                    if (value == "normal") {
+                        params.distribution = LinkParams::Normal;
+                    } else if (value == "uniform") {
+                        params.distribution = LinkParams::Uniform;
+                    } else if (value == "exponential") {
+                        params.distribution = LinkParams::Exponential;
+                    } else {
+                        LOG(ERROR) << "Unknown link distribution:" << value;
+                        throw std::runtime_error("Unknown link distribution: " + value);
+                    }
+                } else if (key == "loss") {
+                    params.loss = std::stod(value);
+                } else if (key == "reorder") {
+                    params.reorder = std::stod(value);
+                } else if (key == "reorder_delay") {
+                    params.reorder_ms = std::stod(value);
+                } else if (key == "bandwidth") {
+                    params.bandwidth_bytes_per_sec = std::stod(value);
+                } else if (key == "partitioned") {
+                    params.partitioned = value == "1";
+                } else {
+                    LOG(ERROR) << "Unknown link option:" << key;
+                    throw std::runtime_error("Unknown link option: " + key);
+                }
+            }
+        }
+    };
+}
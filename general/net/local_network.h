@@ -0,0 +1,128 @@
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+#include "message.h"
+
+namespace net {
+
+    /**
+     * Receiving side of a @Server on @LocalNetwork. Messages are passed to callback on the server context,
+     * messages of one sender one after another in the order they were sent, as over one connection.
+     */
+    struct LocalEndpoint {
+
+        /**
+         * LocalEndpoint constructor
+         * @param context Context callbacks run on
+         * @param callback Message received callback
+         * @param serial Whether context runs on one thread. Then it keeps order itself and no strands are needed
+         */
+        LocalEndpoint(asio::io_context &context, IMessageReceivedCallback *callback, bool serial)
+                : context(context), callback(callback), serial(serial) {}
+
+        /**
+         * Pass own copy of message to callback. Dropped after close
+         * @param sender Sending server. Messages of one sender are handled in order
+         * @param message Message that was sent
+         */
+        void deliver(const void *sender, SharedMessage message) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed) return;
+            auto handler = [this, message = std::move(message)]() {
+                Message copy(*message);
+                copy.cur_pos = 0;
+                try {
+                    callback->on_message_received(copy);
+                } catch (const std::runtime_error &e) {
+                    LOG(ERROR) << "Error handling local message:" << e.what();
+                }
+            };
+            if (serial) {
+                asio::post(context, std::move(handler));
+                return;
+            }
+            auto it = strands.find(sender);
+            if (it == strands.end()) {
+                it = strands.emplace(sender, asio::make_strand(context)).first;
+            }
+            asio::post(it->second, std::move(handler));
+        }
+
+        /**
+         * Drop messages delivered from now on
+         */
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            strands.clear();
+        }
+
+    private:
+        asio::io_context &context;
+        IMessageReceivedCallback *callback;
+        bool serial;
+
+        std::mutex mutex;
+        bool closed = false;
+        // one strand per sender when context runs on several threads
+        std::unordered_map<const void *, asio::strand<asio::io_context::executor_type>> strands;
+    };
+
+    /**
+     * Servers of one process that exchange messages without sockets, e.g. nodes of an in-process cluster.
+     * Servers are found by port, so every server needs its own port while nothing is bound to it. Thread safe.
+     */
+    struct LocalNetwork {
+
+        /**
+         * Network shared by all servers of the process. Never destroyed
+         * @return global network
+         */
+        static LocalNetwork &instance() {
+            static auto *network = new LocalNetwork();
+            return *network;
+        }
+
+        /**
+         * Make endpoint reachable
+         * @param port Port of server
+         * @param endpoint Receiving side of server
+         */
+        void attach(uint64_t port, std::shared_ptr<LocalEndpoint> endpoint) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (!endpoints.emplace(port, std::move(endpoint)).second) {
+                LOG(ERROR) << "Local port already in use:" << port;
+                throw std::runtime_error("Local port already in use " + std::to_string(port));
+            }
+        }
+
+        /**
+         * Make endpoint of @port unreachable
+         */
+        void detach(uint64_t port) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            endpoints.erase(port);
+        }
+
+        /**
+         * @return endpoint of @port, or nullptr when no server is attached to it
+         */
+        std::shared_ptr<LocalEndpoint> find(uint64_t port) const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = endpoints.find(port);
+            return it == endpoints.end() ? nullptr : it->second;
+        }
+
+    private:
+        mutable std::shared_mutex mutex;
+        std::unordered_map<uint64_t, std::shared_ptr<LocalEndpoint>> endpoints;
+    };
+}
@@ -1,41 +1,355 @@
 #pragma once
 
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <type_traits>
+
 #include "../logger.h"
+#include "../lattice.h"
+#include "buffer_pool.h"
 
 namespace net {
 
+    /**
+     * Wire encoding of message values. Receiver learns it from frame header, so messages in different encodings mix
+     * on one connection and every message type may pick its own.
+     */
+    enum class Encoding : uint8_t {
+        // values are written as their bytes
+        Fixed = 0,
+        // integers are LEB128 varints, doubles with short binary fraction are scaled varints,
+        // sorted element lists are varint gaps
+        Compact = 1
+    };
+
+    // newest known encoding. Frames in newer encodings are rejected
+    constexpr Encoding MAX_ENCODING = Encoding::Compact;
+
+    // doubles that are multiples of 1 / COMPACT_DOUBLE_SCALE are written as varints in compact encoding
+    constexpr double COMPACT_DOUBLE_SCALE = 256;
+
+    // types written as varints in compact encoding. Single bytes are written as they are
+    template<typename T>
+    concept VarintEncoded = (std::is_integral_v<T> || std::is_enum_v<T>) && sizeof(T) > 1;
+
+    inline uint64_t zigzag_encode(int64_t value) {
+        return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    }
+
+    inline int64_t zigzag_decode(uint64_t value) {
+        return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    }
+
+    /**
+     * @param value encoded number
+     * @return number of bytes in LEB128 form of @value
+     */
+    inline size_t varint_size(uint64_t value) {
+        return (70 - __builtin_clzll(value | 1)) / 7;
+    }
+
+    /**
+     * Writes LEB128 varint: 7 bits per byte, lowest first, high bit set on all bytes but last.
+     * @param dst where varint is written. Should have room for 10 bytes
+     * @param value written number
+     * @return number of written bytes
+     */
+    inline size_t encode_varint(uint8_t *dst, uint64_t value) {
+        size_t len = 0;
+        while (value >= 0x80) {
+            dst[len++] = (uint8_t) (value | 0x80);
+            value >>= 7;
+        }
+        dst[len++] = (uint8_t) value;
+        return len;
+    }
+
+    /**
+     * Varint written for integer in compact encoding. Signed values are zigzag encoded
+     */
+    template<VarintEncoded T>
+    uint64_t to_varint(const T &val) {
+        if constexpr (std::is_enum_v<T>) {
+            return to_varint(static_cast<std::underlying_type_t<T>>(val));
+        } else if constexpr (std::is_signed_v<T>) {
+            return zigzag_encode((int64_t) val);
+        } else {
+            return (uint64_t) val;
+        }
+    }
+
+    /**
+     * Integer read from varint. Throws when @varint does not fit @T
+     */
+    template<VarintEncoded T>
+    T from_varint(uint64_t varint) {
+        if constexpr (std::is_enum_v<T>) {
+            return static_cast<T>(from_varint<std::underlying_type_t<T>>(varint));
+        } else {
+            T val = std::is_signed_v<T> ? (T) zigzag_decode(varint) : (T) varint;
+            if (to_varint(val) != varint) {
+                throw std::runtime_error("Varint out of range");
+            }
+            return val;
+        }
+    }
+
+    /**
+     * Varint written for double in compact encoding. Even tag holds zigzag of value scaled by
+     * @COMPACT_DOUBLE_SCALE, tag 1 is followed by the 8 bytes of value
+     */
+    inline uint64_t compact_double_tag(double value) {
+        double scaled = value * COMPACT_DOUBLE_SCALE;
+        if (std::isfinite(scaled) && scaled == std::floor(scaled) && std::fabs(scaled) < 0x1p52) {
+            return zigzag_encode((int64_t) scaled) << 1;
+        }
+        return 1;
+    }
+
+    struct Message;
+
+    /**
+     * Value written with its length in front, so receiver may skip it without deserializing.
+     * Sender writes "message << Lazy(value)". Receiver reads Lazy, which only remembers where the value lies in
+     * receive buffer, and calls get() when handler actually uses the value.
+     * Received view is valid while the message it was read from is, i.e. until on_message_received returns.
+     * @tparam T Serializable type
+     */
+    template<typename T>
+    struct Lazy {
+
+        Lazy() = default;
+
+        /**
+         * Value to send. Should outlive serialization
+         */
+        explicit Lazy(const T &value) : value(&value) {}
+
+        /**
+         * Deserializes received value from receive buffer.
+         * @return value. For sending side, copy of wrapped value
+         */
+        T get() const;
+
+        /**
+         * @return number of bytes value takes in message
+         */
+        [[nodiscard]] uint64_t bytes() const {
+            return end - begin;
+        }
+
+        // value wrapped by sender
+        const T *value = nullptr;
+        // message value was read from, and its bytes [begin, end) there
+        Message *source = nullptr;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+    };
+
+    /**
+     * Serialization stream that only counts bytes. Accepts everything @Message does.
+     * Used to size a message buffer before values are written.
+     */
+    struct SizeCounter {
+
+        explicit SizeCounter(Encoding encoding = Encoding::Fixed) : encoding(encoding) {}
+
+        template<typename T> requires (!Lattice<T>)
+        SizeCounter& operator<<(const T &val) {
+            if (encoding == Encoding::Compact) {
+                if constexpr (VarintEncoded<T>) {
+                    size += varint_size(to_varint(val));
+                    return *this;
+                } else if constexpr (std::is_same_v<T, double>) {
+                    uint64_t tag = compact_double_tag(val);
+                    size += varint_size(tag) + (tag == 1 ? sizeof(double) : 0);
+                    return *this;
+                }
+            }
+            size += sizeof(T);
+            return *this;
+        }
+
+        template<Lattice L>
+        SizeCounter& operator<<(const L &val) {
+            val.serialize(*this);
+            return *this;
+        }
+
+        template<typename T>
+        SizeCounter& operator<<(const std::vector<T> &val) {
+            *this << val.size();
+            for (const auto &elem : val) {
+                *this << elem;
+            }
+            return *this;
+        }
+
+        template<typename L, typename R>
+        SizeCounter& operator<<(const std::pair<L, R> &val) {
+            *this << val.first;
+            *this << val.second;
+            return *this;
+        }
+
+        template<typename T>
+        SizeCounter& operator<<(const Lazy<T> &val) {
+            SizeCounter inner(encoding);
+            inner << *val.value;
+            *this << inner.size;
+            size += inner.size;
+            return *this;
+        }
+
+        void write(const void *, size_t len) {
+            size += len;
+        }
+
+        void write_sorted(const uint64_t *values, size_t count, std::optional<uint64_t> previous = std::nullopt) {
+            if (encoding == Encoding::Fixed) {
+                size += count * sizeof(uint64_t);
+                return;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                size += varint_size(previous ? values[i] - *previous - 1 : values[i]);
+                previous = values[i];
+            }
+        }
+
+        Encoding encoding;
+
+        // number of bytes written so far
+        uint64_t size = 0;
+    };
+
     /**
      * Message type.
      * Used by LA Protocols to serialize and deserialize messages using "<<" and ">>" operators and communicate with each other.
      */
     struct Message {
 
+        Message() = default;
+
         /**
-         * Serializes trivial type and writes it to buffer.
+         * Empty message written in @encoding
+         */
+        explicit Message(Encoding encoding) : encoding(encoding) {}
+
+        Message(const Message &other) : size(other.size), cur_pos(other.cur_pos), encoding(other.encoding) {
+            reserve(other.data.size());
+            data.assign(other.data.begin(), other.data.end());
+        }
+
+        Message(Message &&other) noexcept = default;
+
+        Message &operator=(const Message &other) {
+            if (this != &other) {
+                data.clear();
+                reserve(other.data.size());
+                data.assign(other.data.begin(), other.data.end());
+                size = other.size;
+                cur_pos = other.cur_pos;
+                encoding = other.encoding;
+            }
+            return *this;
+        }
+
+        Message &operator=(Message &&other) noexcept {
+            if (this != &other) {
+                BufferPool::instance().release(std::move(data));
+                data = std::move(other.data);
+                size = other.size;
+                cur_pos = other.cur_pos;
+                encoding = other.encoding;
+            }
+            return *this;
+        }
+
+        /**
+         * Buffer is returned to @BufferPool
+         */
+        ~Message() {
+            BufferPool::instance().release(std::move(data));
+        }
+
+        /**
+         * Builds message from values. Values are measured with @SizeCounter first, so buffer is allocated once.
+         * @tparam Ts Serializable types
+         * @param values Values written in order
+         * @return message holding @values
+         */
+        template<typename... Ts>
+        static Message build(const Ts &...values) {
+            return build_as(Encoding::Fixed, values...);
+        }
+
+        /**
+         * Builds message from values in given encoding. Buffer is allocated once.
+         * @tparam Ts Serializable types
+         * @param encoding Wire encoding of values
+         * @param values Values written in order
+         * @return message holding @values
+         */
+        template<typename... Ts>
+        static Message build_as(Encoding encoding, const Ts &...values) {
+            SizeCounter counter(encoding);
+            (counter << ... << values);
+            Message message(encoding);
+            message.reserve(counter.size);
+            (message << ... << values);
+            return message;
+        }
+
+        /**
+         * Make buffer hold at least @bytes without reallocation. New buffer is taken from @BufferPool
+         * @param bytes Required capacity
+         */
+        void reserve(uint64_t bytes) {
+            if (data.capacity() >= bytes) return;
+            std::vector<uint8_t> buffer = BufferPool::instance().acquire(bytes);
+            buffer.assign(data.begin(), data.end());
+            BufferPool::instance().release(std::move(data));
+            data = std::move(buffer);
+        }
+
+        /**
+         * Serializes trivial type and writes it to buffer. In compact encoding integers and doubles are varints.
          * @tparam T Serializable type. Should be trivially copiable
          * @param val Serializable value
          * @return reference to this
          */
-        template<typename T>
+        template<typename T> requires (!Lattice<T>)
         Message& operator<<(const T &val) {
-            size_t cur_size = data.size();
-            data.resize(cur_size + sizeof(T));
-            memcpy(data.data() + cur_size, &val, sizeof(T));
-            size = data.size();
+            if (encoding == Encoding::Compact) {
+                if constexpr (VarintEncoded<T>) {
+                    write_varint(to_varint(val));
+                    return *this;
+                } else if constexpr (std::is_same_v<T, double>) {
+                    uint64_t tag = compact_double_tag(val);
+                    write_varint(tag);
+                    if (tag == 1) {
+                        memcpy(extend(sizeof(T)), &val, sizeof(T));
+                    }
+                    return *this;
+                }
+            }
+            memcpy(extend(sizeof(T)), &val, sizeof(T));
             return *this;
         }
 
         /**
-         * Serializes @LatticeSet and writes it to buffer.
-         * @param val Serializable set
+         * Serializes lattice and writes it to buffer.
+         * @tparam L Serializable lattice
+         * @param val Serializable value
          * @return reference to this
          */
-        template<>
-        Message& operator<<(const LatticeSet &val) {
-            *this << val.set.size();
-            for (const auto &elem : val.set) {
-                *this << elem;
-            }
+        template<Lattice L>
+        Message& operator<<(const L &val) {
+            val.serialize(*this);
             return *this;
         }
 
@@ -68,14 +382,53 @@ namespace net {
             return *this;
         }
 
+        /**
+         * Serializes value prefixed with its length in bytes.
+         * @tparam T Type of wrapped value. Should be serializable using "<<" operator
+         * @param val Wrapped value
+         * @return reference to this
+         */
+        template<typename T>
+        Message& operator<<(const Lazy<T> &val) {
+            SizeCounter counter(encoding);
+            counter << *val.value;
+            *this << counter.size;
+            reserve(data.size() + counter.size);
+            *this << *val.value;
+            return *this;
+        }
+
         /**
          * Deserializes value.
          * @tparam T Deserializable type. Should be trivially copyable
          * @param val Where deserialized value will be written
          * @return reference to this
          */
-        template<typename T>
+        template<typename T> requires (!Lattice<T>)
         Message& operator>>(T &val) {
+            if (encoding == Encoding::Compact) {
+                if constexpr (VarintEncoded<T>) {
+                    uint64_t varint = read_varint();
+                    try {
+                        val = from_varint<T>(varint);
+                    } catch (const std::runtime_error &e) {
+                        LOG(ERROR) << "Invalid read:" << e.what();
+                        throw;
+                    }
+                    return *this;
+                } else if constexpr (std::is_same_v<T, double>) {
+                    uint64_t tag = read_varint();
+                    if (tag == 1) {
+                        read(&val, sizeof(T));
+                    } else if (tag & 1) {
+                        LOG(ERROR) << "Invalid double tag";
+                        throw std::runtime_error("Invalid double tag");
+                    } else {
+                        val = (double) zigzag_decode(tag >> 1) / COMPACT_DOUBLE_SCALE;
+                    }
+                    return *this;
+                }
+            }
             if (data.size() < cur_pos + sizeof(T)) {
                 LOG(ERROR) << "Invalid read";
                 throw std::runtime_error("Invalid read");
@@ -88,18 +441,24 @@ namespace net {
         }
 
         /**
-         * Deserializes @LatticeSet.
+         * Deserializes lattice. Received value is joined into @val.
+         * @tparam L Deserializable lattice
          * @param val Where deserialized value will be written
          * @return reference to this
          */
-        template<>
-        Message& operator>>(LatticeSet &val) {
-            uint64_t size;
-            *this >> size;
-            for (uint64_t i = 0; i < size; ++i) {
-                uint64_t elem;
-                *this >> elem;
-                val.insert(elem);
+        template<Lattice L>
+        Message& operator>>(L &val) {
+            L received;
+            try {
+                received.deserialize(*this);
+            } catch (const std::runtime_error &e) {
+                LOG(ERROR) << "Invalid read:" << e.what();
+                throw;
+            }
+            if (val.empty()) {
+                val = std::move(received);
+            } else {
+                val.join_into(received);
             }
             return *this;
         }
@@ -114,10 +473,11 @@ namespace net {
         Message &operator>>(std::vector<T> &val) {
             uint64_t size;
             *this >> size;
+            val.reserve(val.size() + std::min(size, remaining()));
             for (uint64_t i = 0; i < size; ++i) {
                 T elem;
                 *this >> elem;
-                val.push_back(elem);
+                val.push_back(std::move(elem));
             }
             return *this;
         }
@@ -136,6 +496,169 @@ namespace net {
             return *this;
         }
 
+        /**
+         * Skips value written as @Lazy and remembers where it lies. Nothing is deserialized.
+         * @tparam T Type of wrapped value
+         * @param val Where view of the value will be written
+         * @return reference to this
+         */
+        template<typename T>
+        Message& operator>>(Lazy<T> &val) {
+            uint64_t len;
+            *this >> len;
+            if (len > remaining()) {
+                LOG(ERROR) << "Invalid read";
+                throw std::runtime_error("Invalid read");
+            }
+            val.value = nullptr;
+            val.source = this;
+            val.begin = cur_pos;
+            val.end = cur_pos + len;
+            cur_pos = val.end;
+            return *this;
+        }
+
+        /**
+         * Appends raw bytes to buffer.
+         * @param src Pointer to bytes
+         * @param len Number of bytes
+         */
+        void write(const void *src, size_t len) {
+            if (len == 0) return;
+            memcpy(extend(len), src, len);
+        }
+
+        /**
+         * Reads raw bytes from buffer.
+         * @param dst Where bytes will be written
+         * @param len Number of bytes
+         */
+        void read(void *dst, size_t len) {
+            if (data.size() < cur_pos + len) {
+                LOG(ERROR) << "Invalid read";
+                throw std::runtime_error("Invalid read");
+            }
+            if (len == 0) return;
+            memcpy(dst, data.data() + cur_pos, len);
+            cur_pos += len;
+        }
+
+        /**
+         * Writes LEB128 varint, see @encode_varint.
+         * @param value Written number
+         */
+        void write_varint(uint64_t value) {
+            uint8_t bytes[10];
+            size_t len = encode_varint(bytes, value);
+            memcpy(extend(len), bytes, len);
+        }
+
+        /**
+         * Reads LEB128 varint.
+         * @return read number
+         */
+        uint64_t read_varint() {
+            uint64_t value = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                if (cur_pos >= data.size()) {
+                    LOG(ERROR) << "Invalid read";
+                    throw std::runtime_error("Invalid read");
+                }
+                uint8_t byte = data[cur_pos++];
+                value |= (uint64_t) (byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            LOG(ERROR) << "Invalid varint";
+            throw std::runtime_error("Invalid varint");
+        }
+
+        /**
+         * Writes strictly increasing elements. Fixed encoding copies them in one block, compact encoding writes
+         * the first element and then every gap minus one as varints, so dense sets take a byte per element.
+         * @param values Elements
+         * @param count Number of elements
+         * @param previous Last element written before @values when one list is written in several parts
+         */
+        void write_sorted(const uint64_t *values, size_t count, std::optional<uint64_t> previous = std::nullopt) {
+            if (encoding == Encoding::Fixed) {
+                write(values, count * sizeof(uint64_t));
+                return;
+            }
+            reserve(data.size() + count);
+            // varints are encoded in blocks on stack, so buffer grows once per block
+            constexpr size_t BLOCK = 256;
+            uint8_t bytes[BLOCK * 10];
+            for (size_t begin = 0; begin < count; begin += BLOCK) {
+                size_t len = 0;
+                for (size_t i = begin; i < std::min(count, begin + BLOCK); ++i) {
+                    len += encode_varint(bytes + len, previous ? values[i] - *previous - 1 : values[i]);
+                    previous = values[i];
+                }
+                memcpy(extend(len), bytes, len);
+            }
+        }
+
+        /**
+         * Reads list written by write_sorted in one or several parts.
+         * @param values Where elements will be written
+         * @param count Number of elements
+         */
+        void read_sorted(uint64_t *values, size_t count) {
+            if (encoding == Encoding::Fixed) {
+                read(values, count * sizeof(uint64_t));
+                return;
+            }
+            // locals, so stores to @values do not force reloads of members
+            const uint8_t *ptr = data.data() + cur_pos;
+            const uint8_t *end = data.data() + data.size();
+            uint64_t last = 0;
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t varint;
+                if (end - ptr >= 10) {
+                    // whole varint is in buffer, bytes are read without bounds checks
+                    varint = 0;
+                    uint8_t byte;
+                    unsigned shift = 0;
+                    do {
+                        byte = *ptr++;
+                        varint |= (uint64_t) (byte & 0x7f) << shift;
+                        shift += 7;
+                    } while ((byte & 0x80) && shift < 70);
+                    if (byte & 0x80) {
+                        LOG(ERROR) << "Invalid varint";
+                        throw std::runtime_error("Invalid varint");
+                    }
+                } else {
+                    cur_pos = ptr - data.data();
+                    varint = read_varint();
+                    ptr = data.data() + cur_pos;
+                }
+                uint64_t value = i == 0 ? varint : last + varint + 1;
+                if (i > 0 && value <= last) {
+                    LOG(ERROR) << "Invalid sorted list";
+                    throw std::runtime_error("Invalid sorted list");
+                }
+                values[i] = last = value;
+            }
+            cur_pos = ptr - data.data();
+        }
+
+        /**
+         * Upper bound of list length that fits in the rest of message. Used to validate sizes before allocation.
+         * @param elem_size Size of element in fixed encoding
+         * @return largest number of elements left to read
+         */
+        [[nodiscard]] uint64_t max_elements(size_t elem_size) const {
+            return encoding == Encoding::Compact ? remaining() : remaining() / elem_size;
+        }
+
+        /**
+         * @return number of bytes left to read
+         */
+        [[nodiscard]] uint64_t remaining() const {
+            return data.size() - cur_pos;
+        }
+
         /**
          * Get size of message in bytes
          * @return message size in bytes
@@ -153,7 +676,7 @@ namespace net {
         }
         
         // size of message in bytes
-        uint64_t size;
+        uint64_t size = 0;
 
         // actual message data
         std::vector<uint8_t> data;
@@ -161,8 +684,60 @@ namespace net {
         // current position of data pointer
         uint64_t cur_pos = 0;
 
+        // how values are written. Carried in frame header
+        Encoding encoding = Encoding::Fixed;
+
+    private:
+
+        /**
+         * Grows buffer by @len bytes. Capacity at least doubles, so appends are amortized O(1)
+         * @param len Number of appended bytes
+         * @return pointer to appended bytes
+         */
+        uint8_t *extend(size_t len) {
+            size_t cur_size = data.size();
+            if (cur_size + len > data.capacity()) {
+                reserve(std::max<uint64_t>(cur_size + len, 2 * data.capacity()));
+            }
+            data.resize(cur_size + len);
+            size = data.size();
+            return data.data() + cur_size;
+        }
     };
 
+    /**
+     * Serialized message shared by every connection it is sent to. Never modified after it is shared,
+     * so a broadcast keeps one buffer whatever the number of receivers.
+     */
+    using SharedMessage = std::shared_ptr<const Message>;
+
+    template<typename T>
+    T Lazy<T>::get() const {
+        if (value) {
+            return *value;
+        }
+        if (!source) {
+            LOG(ERROR) << "Lazy value was not read";
+            throw std::runtime_error("Lazy value was not read");
+        }
+        uint64_t saved = source->cur_pos;
+        source->cur_pos = begin;
+        T result;
+        try {
+            *source >> result;
+        } catch (...) {
+            source->cur_pos = saved;
+            throw;
+        }
+        bool consumed = source->cur_pos == end;
+        source->cur_pos = saved;
+        if (!consumed) {
+            LOG(ERROR) << "Invalid lazy value length";
+            throw std::runtime_error("Invalid lazy value length");
+        }
+        return result;
+    }
+
     /**
      * Message Callback. Used by @Server to notify LA Protocols when message received.
      */
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+#include "message.h"
+
+namespace net {
+
+    /**
+     * Configuration of @MulticastChannel.
+     */
+    struct MulticastOptions {
+        // multicast group address, e.g. 239.255.0.1
+        std::string group;
+        uint16_t port = 0;
+        // address of local interface that joins the group. 0.0.0.0 lets system pick
+        std::string interface = "0.0.0.0";
+        // id of this process
+        uint64_t self = 0;
+        // number of processes in the group, including this one
+        uint64_t group_size = 0;
+        // largest datagram including header. Default fits ethernet MTU
+        uint64_t max_datagram = 1472;
+        // datagrams kept for retransmission. Also the receive window per sender
+        uint64_t history = 8192;
+        // how often lost datagrams are requested again and heartbeats are sent
+        std::chrono::milliseconds tick{10};
+        // multicast hops
+        int ttl = 1;
+
+        /**
+         * Parse "group:port" or "group:port@interface", e.g. "239.255.0.1:30000@127.0.0.1"
+         * @param address group address
+         * @param self id of this process
+         * @param group_size number of processes in the group
+         * @return options with defaults for everything else
+         */
+        static MulticastOptions parse(const std::string &address, uint64_t self, uint64_t group_size) {
+            MulticastOptions options;
+            std::string group = address;
+            auto at = group.find('@');
+            if (at != std::string::npos) {
+                options.interface = group.substr(at + 1);
+                group = group.substr(0, at);
+            }
+            auto colon = group.rfind(':');
+            if (colon == std::string::npos) {
+                LOG(ERROR) << "Invalid multicast address:" << address;
+                throw std::runtime_error("Invalid multicast address " + address);
+            }
+            options.group = group.substr(0, colon);
+            options.port = (uint16_t) std::stoul(group.substr(colon + 1));
+            options.self = self;
+            options.group_size = group_size;
+            return options;
+        }
+    };
+
+    /**
+     * Header of every datagram. Written in host byte order, like the rest of the wire format.
+     */
+    struct DatagramHeader {
+        uint8_t kind;
+        // @Encoding of message, for Data
+        uint8_t encoding;
+        uint16_t reserved;
+        // Data: number of fragments of message
+        uint32_t fragments;
+        // process that sent datagram
+        uint64_t sender;
+        // Data: sequence of datagram. Heartbeat: next sequence. Nack: first missing. Gone: first retained
+        uint64_t sequence;
+        // Data: sequence of first fragment of message. Nack: end of missing range
+        uint64_t first;
+    };
+    static_assert(sizeof(DatagramHeader) == 32);
+
+    /**
+     * Reliable ordered broadcast over UDP multicast. One send reaches every process of the group.
+     * Message is split into fragments that fit one datagram, and every datagram of a sender gets next sequence number.
+     * Receivers deliver messages of each sender in order. Gaps are requested from sender with Nack datagrams
+     * every tick, and sender retransmits them from its history by unicast. Senders multicast Heartbeat with their
+     * next sequence every tick, so loss of the last datagram is noticed too. Datagrams that left sender history
+     * are lost for good: sender answers with Gone, receiver logs it and skips them.
+     * Group traffic is received on a socket bound to group port, everything else on a per-process socket
+     * that also sends, so processes of one host may share a group.
+     * All work runs on one strand, so messages from the group are passed to callback one after another.
+     */
+    struct MulticastChannel {
+
+        enum Kind : uint8_t {
+            Data = 0,
+            Nack = 1,
+            Heartbeat = 2,
+            Gone = 3
+        };
+
+        // socket receive buffer. Large, since a broadcast arrives as a burst of datagrams
+        static constexpr int RECEIVE_BUFFER_SIZE = 4 * 1024 * 1024;
+        // missing ranges requested from one sender per tick
+        static constexpr uint64_t MAX_NACKS_PER_TICK = 64;
+
+        /**
+         * MulticastChannel constructor
+         * @param context context where async calls will be executed
+         * @param options group configuration
+         * @param callback message received callback
+         * @param max_message_size largest message accepted from group
+         */
+        MulticastChannel(asio::io_context &context, const MulticastOptions &options,
+                         IMessageReceivedCallback *callback, uint64_t max_message_size)
+                : options(options),
+                  callback(callback),
+                  max_size(std::min(max_message_size, options.history * payload_size())),
+                  strand(asio::make_strand(context)),
+                  group_receiver(strand, options.max_datagram),
+                  unicast_receiver(strand, options.max_datagram),
+                  tick_timer(strand),
+                  group_endpoint(asio::ip::make_address_v4(options.group), options.port) {
+            if (options.max_datagram <= sizeof(DatagramHeader)) {
+                LOG(ERROR) << "Multicast datagram of" << options.max_datagram << "bytes can not hold header";
+                throw std::runtime_error("Multicast datagram too small");
+            }
+        }
+
+        /**
+         * Join group and start receiving
+         */
+        void start() {
+            auto interface = asio::ip::make_address_v4(options.interface);
+            auto &group_socket = group_receiver.socket;
+            group_socket.open(asio::ip::udp::v4());
+            group_socket.set_option(asio::ip::udp::socket::reuse_address(true));
+            group_socket.bind(asio::ip::udp::endpoint(asio::ip::address_v4::any(), options.port));
+            group_socket.set_option(asio::ip::multicast::join_group(group_endpoint.address().to_v4(), interface));
+            group_socket.set_option(asio::socket_base::receive_buffer_size(RECEIVE_BUFFER_SIZE));
+
+            auto &unicast_socket = unicast_receiver.socket;
+            unicast_socket.open(asio::ip::udp::v4());
+            unicast_socket.bind(asio::ip::udp::endpoint(interface, 0));
+            unicast_socket.set_option(asio::ip::multicast::outbound_interface(interface));
+            unicast_socket.set_option(asio::ip::multicast::hops(options.ttl));
+            unicast_socket.set_option(asio::ip::multicast::enable_loopback(true));
+            unicast_socket.set_option(asio::socket_base::receive_buffer_size(RECEIVE_BUFFER_SIZE));
+
+            receive(group_receiver);
+            receive(unicast_receiver);
+            schedule_tick();
+        }
+
+        /**
+         * Close sockets. Context should be stopped
+         */
+        void close() {
+            tick_timer.cancel();
+            group_receiver.socket.close();
+            unicast_receiver.socket.close();
+        }
+
+        /**
+         * Send message to every other process of the group. Thread safe
+         * @param message Message that will be sent. Should not exceed max_message_size
+         */
+        void send(SharedMessage message) {
+            asio::post(strand, [this, message = std::move(message)]() {
+                uint64_t payload = payload_size();
+                uint64_t size = message->get_size();
+                auto fragments = (uint32_t) std::max<uint64_t>(1, (size + payload - 1) / payload);
+                uint64_t first = next_sequence;
+                for (uint32_t i = 0; i < fragments; ++i) {
+                    uint64_t offset = i * payload;
+                    uint64_t len = std::min(payload, size - offset);
+                    DatagramHeader header{Data, (uint8_t) message->encoding, 0, fragments, options.self,
+                                          next_sequence++, first};
+                    std::vector<uint8_t> datagram(sizeof(header) + len);
+                    std::memcpy(datagram.data(), &header, sizeof(header));
+                    if (len > 0) {
+                        std::memcpy(datagram.data() + sizeof(header), message->data.data() + offset, len);
+                    }
+                    transmit(datagram, group_endpoint);
+                    history.push_back(std::move(datagram));
+                    if (history.size() > options.history) {
+                        history.pop_front();
+                        ++history_base;
+                    }
+                }
+            });
+        }
+
+        /**
+         * @return largest message that may be sent over the group
+         */
+        [[nodiscard]] uint64_t max_message_size() const {
+            return max_size;
+        }
+
+    private:
+        using Strand = asio::strand<asio::io_context::executor_type>;
+
+        /**
+         * Socket with buffer its datagrams are received into
+         */
+        struct Receiver {
+            Receiver(const Strand &strand, uint64_t max_datagram) : socket(strand), buffer(max_datagram) {}
+
+            asio::ip::udp::socket socket;
+            std::vector<uint8_t> buffer;
+            asio::ip::udp::endpoint source;
+        };
+
+        /**
+         * What this process received from one sender
+         */
+        struct Stream {
+            // sequence of next datagram to deliver. It always starts a message
+            uint64_t next = 0;
+            // every datagram in [next, contiguous) is received
+            uint64_t contiguous = 0;
+            // sequence after the last one sender is known to have sent
+            uint64_t known = 0;
+            // received datagrams with sequence >= next, header included
+            std::map<uint64_t, std::vector<uint8_t>> pending;
+            // where sender takes retransmission requests
+            asio::ip::udp::endpoint source;
+        };
+
+        MulticastOptions options;
+        IMessageReceivedCallback *callback;
+        uint64_t max_size;
+
+        Strand strand;
+        Receiver group_receiver;
+        Receiver unicast_receiver;
+        asio::steady_timer tick_timer;
+        asio::ip::udp::endpoint group_endpoint;
+
+        // sequence of next sent datagram
+        uint64_t next_sequence = 0;
+        // sent datagrams kept for retransmission. history[0] has sequence history_base
+        std::deque<std::vector<uint8_t>> history;
+        uint64_t history_base = 0;
+
+        std::unordered_map<uint64_t, Stream> streams;
+        // message passed to callback. Its data is reused between messages
+        Message message;
+
+        [[nodiscard]] uint64_t payload_size() const {
+            return options.max_datagram - sizeof(DatagramHeader);
+        }
+
+        void transmit(const std::vector<uint8_t> &datagram, const asio::ip::udp::endpoint &to) {
+            asio::error_code er;
+            unicast_receiver.socket.send_to(asio::buffer(datagram), to, 0, er);
+            if (er) {
+                LOG(ERROR) << "Error sending datagram:" << er.message();
+            }
+        }
+
+        void transmit(const DatagramHeader &header, const asio::ip::udp::endpoint &to) {
+            std::vector<uint8_t> datagram(sizeof(header));
+            std::memcpy(datagram.data(), &header, sizeof(header));
+            transmit(datagram, to);
+        }
+
+        void receive(Receiver &receiver) {
+            receiver.socket.async_receive_from(
+                asio::buffer(receiver.buffer), receiver.source,
+                [this, &receiver](const asio::error_code &er, size_t len) {
+                    if (er == asio::error::operation_aborted) return;
+                    if (er) {
+                        LOG(ERROR) << "Error receiving datagram:" << er.message();
+                    } else {
+                        handle(receiver.buffer.data(), len, receiver.source);
+                    }
+                    receive(receiver);
+                });
+        }
+
+        void handle(const uint8_t *data, size_t len, const asio::ip::udp::endpoint &source) {
+            DatagramHeader header;
+            if (len < sizeof(header)) {
+                LOG(ERROR) << "Datagram of" << len << "bytes is too short";
+                return;
+            }
+            std::memcpy(&header, data, sizeof(header));
+            if (header.sender == options.self) return;
+            switch (header.kind) {
+                case Data:
+                    on_data(header, data, len, source);
+                    break;
+                case Nack:
+                    on_nack(header, source);
+                    break;
+                case Heartbeat: {
+                    Stream &stream = stream_of(header.sender, source);
+                    stream.known = std::max(stream.known, header.sequence);
+                    break;
+                }
+                case Gone:
+                    on_gone(header, source);
+                    break;
+                default:
+                    LOG(ERROR) << "Unknown datagram kind" << (int) header.kind;
+            }
+        }
+
+        Stream &stream_of(uint64_t sender, const asio::ip::udp::endpoint &source) {
+            Stream &stream = streams[sender];
+            stream.source = source;
+            return stream;
+        }
+
+        void on_data(const DatagramHeader &header, const uint8_t *data, size_t len,
+                     const asio::ip::udp::endpoint &source) {
+            if (header.fragments == 0 || header.fragments > options.history || header.first > header.sequence
+                || header.sequence - header.first >= header.fragments || header.encoding > (uint8_t) MAX_ENCODING) {
+                LOG(ERROR) << "Invalid data datagram from" << header.sender;
+                return;
+            }
+            Stream &stream = stream_of(header.sender, source);
+            stream.known = std::max(stream.known, header.sequence + 1);
+            if (header.sequence < stream.next || header.sequence >= stream.next + options.history) return;
+            if (!stream.pending.try_emplace(header.sequence, data, data + len).second) return;
+            while (stream.pending.count(stream.contiguous)) {
+                ++stream.contiguous;
+            }
+            deliver(stream);
+        }
+
+        /**
+         * Passes every complete message at the start of @stream to callback
+         */
+        void deliver(Stream &stream) {
+            while (!stream.pending.empty() && stream.pending.begin()->first == stream.next) {
+                DatagramHeader header;
+                std::memcpy(&header, stream.pending.begin()->second.data(), sizeof(header));
+                if (header.first != stream.next) {
+                    // message started in skipped datagrams
+                    stream.pending.erase(stream.pending.begin());
+                    ++stream.next;
+                    continue;
+                }
+                uint64_t end = header.first + header.fragments;
+                if (stream.contiguous < end) return;
+
+                message.cur_pos = 0;
+                message.encoding = (Encoding) header.encoding;
+                message.data.clear();
+                message.reserve(header.fragments * payload_size());
+                auto it = stream.pending.begin();
+                for (; it != stream.pending.end() && it->first < end; ++it) {
+                    message.data.insert(message.data.end(), it->second.begin() + sizeof(header), it->second.end());
+                }
+                stream.pending.erase(stream.pending.begin(), it);
+                stream.next = end;
+                message.size = message.data.size();
+                if (message.size > max_size) {
+                    LOG(ERROR) << "Multicast message of" << message.size << "bytes exceeds limit" << max_size;
+                    continue;
+                }
+                try {
+                    callback->on_message_received(message);
+                } catch (const std::runtime_error &e) {
+                    LOG(ERROR) << "Exception while handling multicast message:" << e.what();
+                }
+            }
+        }
+
+        void on_nack(const DatagramHeader &header, const asio::ip::udp::endpoint &source) {
+            if (header.sequence < history_base) {
+                transmit(DatagramHeader{Gone, 0, 0, 0, options.self, history_base, 0}, source);
+            }
+            uint64_t end = std::min(header.first, next_sequence);
+            for (uint64_t sequence = std::max(header.sequence, history_base); sequence < end; ++sequence) {
+                transmit(history[sequence - history_base], source);
+            }
+        }
+
+        void on_gone(const DatagramHeader &header, const asio::ip::udp::endpoint &source) {
+            Stream &stream = stream_of(header.sender, source);
+            if (header.sequence <= stream.next) return;
+            LOG(ERROR) << "Lost" << header.sequence - stream.next << "datagrams from" << header.sender;
+            stream.next = header.sequence;
+            stream.pending.erase(stream.pending.begin(), stream.pending.lower_bound(stream.next));
+            stream.contiguous = std::max(stream.contiguous, stream.next);
+            while (stream.pending.count(stream.contiguous)) {
+                ++stream.contiguous;
+            }
+            deliver(stream);
+        }
+
+        /**
+         * Requests missing datagrams of @stream from its sender
+         */
+        void request_missing(Stream &stream) {
+            uint64_t begin = stream.contiguous;
+            auto it = stream.pending.lower_bound(begin);
+            for (uint64_t nacks = 0; begin < stream.known && nacks < MAX_NACKS_PER_TICK; ++nacks) {
+                uint64_t end = it == stream.pending.end() ? stream.known : it->first;
+                transmit(DatagramHeader{Nack, 0, 0, 0, options.self, begin, end}, stream.source);
+                // skip received run
+                begin = end;
+                while (it != stream.pending.end() && it->first == begin) {
+                    ++begin;
+                    ++it;
+                }
+            }
+        }
+
+        void schedule_tick() {
+            tick_timer.expires_after(options.tick);
+            tick_timer.async_wait([this](const asio::error_code &er) {
+                if (er) return;
+                if (next_sequence > 0) {
+                    transmit(DatagramHeader{Heartbeat, 0, 0, 0, options.self, next_sequence, 0}, group_endpoint);
+                }
+                for (auto &stream : streams) {
+                    request_missing(stream.second);
+                }
+                schedule_tick();
+            });
+        }
+    };
+}
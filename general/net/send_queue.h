@@ -0,0 +1,341 @@
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "message.h"
+
+namespace net {
+
+    /**
+     * What @SendQueue does with a message that does not fit.
+     */
+    enum class OverflowPolicy {
+        // message is not queued and send reports it
+        Reject,
+        // caller waits for room. Threads that write the queue can not wait for it, they reject instead
+        Block
+    };
+
+    /**
+     * Limits of one @SendQueue. Messages being written count until they are written.
+     */
+    struct SendQueueOptions {
+        uint64_t max_messages = 64 * 1024;
+        uint64_t max_bytes = 256 * 1024 * 1024;
+        OverflowPolicy overflow = OverflowPolicy::Reject;
+
+        /**
+         * Parse "messages[:bytes[:policy]]" where policy is reject or block, e.g. "4096:16777216:block"
+         * @param value limits
+         * @return options with defaults for everything missing
+         */
+        static SendQueueOptions parse(const std::string &value) {
+            SendQueueOptions options;
+            auto first = value.find(':');
+            options.max_messages = std::stoull(value.substr(0, first));
+            if (first == std::string::npos) return options;
+            auto second = value.find(':', first + 1);
+            options.max_bytes = std::stoull(value.substr(first + 1, second - first - 1));
+            if (second == std::string::npos) return options;
+            std::string policy = value.substr(second + 1);
+            if (policy == "reject") {
+                options.overflow = OverflowPolicy::Reject;
+            } else if (policy == "block") {
+                options.overflow = OverflowPolicy::Block;
+            } else {
+                LOG(ERROR) << "Unknown send queue overflow policy:" << policy;
+                throw std::runtime_error("Unknown send queue overflow policy " + policy);
+            }
+            return options;
+        }
+    };
+
+    /**
+     * Counters of one @SendQueue. Bytes include size prefixes of frames.
+     */
+    struct SendQueueStats {
+        // queued and being written now
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        // largest messages and bytes ever held
+        uint64_t max_messages = 0;
+        uint64_t max_bytes = 0;
+        uint64_t enqueued = 0;
+        uint64_t sent = 0;
+        // replaced by a newer message with the same key before they were written
+        uint64_t coalesced = 0;
+        // not queued because queue was full or closed
+        uint64_t rejected = 0;
+        // queued but never written: dropped for room or because peer was unreachable
+        uint64_t dropped = 0;
+
+        /**
+         * Add counters of @other, e.g. to sum queues of every peer. High water marks are summed as well
+         */
+        void merge(const SendQueueStats &other) {
+            messages += other.messages;
+            bytes += other.bytes;
+            max_messages += other.max_messages;
+            max_bytes += other.max_bytes;
+            enqueued += other.enqueued;
+            sent += other.sent;
+            coalesced += other.coalesced;
+            rejected += other.rejected;
+            dropped += other.dropped;
+        }
+    };
+
+    /**
+     * Bounded queue of messages to one peer, filled by any thread and emptied by the one writer of the peer.
+     * Writer takes a batch, writes it and then completes it, so memory of messages in flight stays accounted.
+     * Message pushed with a nonzero key replaces a queued message with the same key that is not taken yet,
+     * keeping its place, e.g. a newer proposal replaces an older one that did not reach the acceptor.
+     */
+    struct SendQueue {
+
+        // messages with this key are never replaced
+        static constexpr uint64_t NO_KEY = 0;
+
+        explicit SendQueue(SendQueueOptions options = {}) : options(options) {}
+
+        /**
+         * Queue message. Thread safe
+         * @param message Message that will be sent
+         * @param key Message replaces queued message with the same key. @NO_KEY keeps every message
+         * @param may_block Caller is not needed by the writer, so Block policy may wait here
+         * @return false when message was rejected
+         */
+        bool push(SharedMessage message, uint64_t key, bool may_block) {
+            uint64_t size = frame_bytes(*message);
+            std::unique_lock<std::mutex> lock(mutex);
+            if (closed) {
+                ++stats.rejected;
+                return false;
+            }
+            while (true) {
+                // keyed message replaces a queued one in place, only its size changes
+                Entry *replaced = nullptr;
+                if (key != NO_KEY) {
+                    auto it = keyed.find(key);
+                    if (it != keyed.end()) {
+                        replaced = &pending[it->second - first_sequence];
+                    }
+                }
+                if (fits(size, replaced)) {
+                    overflowing = false;
+                    if (replaced) {
+                        replace(*replaced, std::move(message), size);
+                        return true;
+                    }
+                    break;
+                }
+                if (options.overflow == OverflowPolicy::Block && may_block) {
+                    // queued entry with the key may be taken meanwhile, so look it up again
+                    room.wait(lock);
+                    if (closed) {
+                        ++stats.rejected;
+                        return false;
+                    }
+                } else {
+                    if (!overflowing) {
+                        LOG(ERROR) << "Send queue full at" << stats.messages << "messages" << stats.bytes
+                                   << "bytes. Rejecting messages";
+                        overflowing = true;
+                    }
+                    ++stats.rejected;
+                    return false;
+                }
+            }
+            if (key != NO_KEY) {
+                keyed[key] = first_sequence + pending.size();
+            }
+            pending.push_back({std::move(message), key});
+            pending_bytes += size;
+            ++stats.messages;
+            stats.bytes += size;
+            ++stats.enqueued;
+            update_high_water();
+            return true;
+        }
+
+        /**
+         * Move oldest queued messages to @batch. Called by writer
+         * @param batch Messages being written. Taken messages are appended
+         * @param max_bytes Taken messages hold at most this many bytes, but at least one message is taken
+         * @param max_messages At most this many messages are taken
+         */
+        void take(std::vector<SharedMessage> &batch, uint64_t max_bytes,
+                  size_t max_messages = std::numeric_limits<size_t>::max()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t taken_bytes = 0;
+            size_t taken = 0;
+            while (!pending.empty() && taken < max_messages) {
+                uint64_t size = frame_bytes(*pending.front().message);
+                if (taken > 0 && taken_bytes + size > max_bytes) break;
+                taken_bytes += size;
+                ++taken;
+                batch.push_back(pop_front());
+            }
+        }
+
+        /**
+         * Release room of written messages. Called by writer
+         * @param batch Messages that were taken and written
+         */
+        void complete(const std::vector<SharedMessage> &batch) {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.sent += batch.size();
+            release(batch);
+        }
+
+        /**
+         * Drop queued messages and @batch, e.g. when peer is unreachable. Called by writer
+         * @param batch Messages that were taken and not written. Cleared
+         * @return number of dropped messages
+         */
+        uint64_t drop(std::vector<SharedMessage> &batch) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t dropped = batch.size() + pending.size();
+            stats.dropped += dropped;
+            release(batch);
+            batch.clear();
+            clear_pending();
+            room.notify_all();
+            return dropped;
+        }
+
+        /**
+         * Drop every queued message, reject messages from now on and wake waiting callers
+         */
+        void close() {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            stats.dropped += pending.size();
+            clear_pending();
+            room.notify_all();
+        }
+
+        /**
+         * @return true when no message waits to be taken
+         */
+        bool empty() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pending.empty();
+        }
+
+        /**
+         * @return bytes of messages waiting to be taken
+         */
+        uint64_t queued_bytes() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pending_bytes;
+        }
+
+        /**
+         * @return snapshot of counters
+         */
+        SendQueueStats get_stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats;
+        }
+
+    private:
+        struct Entry {
+            SharedMessage message;
+            uint64_t key;
+        };
+
+        SendQueueOptions options;
+        mutable std::mutex mutex;
+        std::condition_variable room;
+        bool closed = false;
+        // full queue was already logged
+        bool overflowing = false;
+
+        // messages not taken yet
+        std::deque<Entry> pending;
+        uint64_t pending_bytes = 0;
+        // sequence of pending.front(). Sequences grow by one per pushed message
+        uint64_t first_sequence = 0;
+        // sequence of pending message by key
+        std::unordered_map<uint64_t, uint64_t> keyed;
+        SendQueueStats stats;
+
+        static uint64_t frame_bytes(const Message &message) {
+            return sizeof(uint64_t) + message.size;
+        }
+
+        /**
+         * @param size Bytes of new message
+         * @param replaced Queued entry the message replaces or nullptr
+         * @return true when queue stays within limits with the message
+         */
+        bool fits(uint64_t size, const Entry *replaced) const {
+            uint64_t others = stats.messages - (replaced ? 1 : 0);
+            // message larger than the whole limit still goes alone
+            if (others == 0) return true;
+            if (!replaced && stats.messages >= options.max_messages) return false;
+            uint64_t bytes = stats.bytes - (replaced ? frame_bytes(*replaced->message) : 0);
+            return bytes + size <= options.max_bytes;
+        }
+
+        void replace(Entry &entry, SharedMessage message, uint64_t size) {
+            uint64_t old_size = frame_bytes(*entry.message);
+            stats.bytes = stats.bytes - old_size + size;
+            pending_bytes = pending_bytes - old_size + size;
+            entry.message = std::move(message);
+            ++stats.enqueued;
+            ++stats.coalesced;
+            update_high_water();
+        }
+
+        /**
+         * Remove first pending entry. It stays in stats, caller accounts for it
+         * @return message of entry
+         */
+        SharedMessage pop_front() {
+            Entry &entry = pending.front();
+            if (entry.key != NO_KEY) {
+                keyed.erase(entry.key);
+            }
+            pending_bytes -= frame_bytes(*entry.message);
+            SharedMessage message = std::move(entry.message);
+            pending.pop_front();
+            ++first_sequence;
+            return message;
+        }
+
+        void release(const std::vector<SharedMessage> &batch) {
+            for (const auto &message : batch) {
+                --stats.messages;
+                stats.bytes -= frame_bytes(*message);
+            }
+            room.notify_all();
+        }
+
+        void clear_pending() {
+            for (const auto &entry : pending) {
+                --stats.messages;
+                stats.bytes -= frame_bytes(*entry.message);
+            }
+            first_sequence += pending.size();
+            pending.clear();
+            pending_bytes = 0;
+            keyed.clear();
+        }
+
+        void update_high_water() {
+            stats.max_messages = std::max(stats.max_messages, stats.messages);
+            stats.max_bytes = std::max(stats.max_bytes, stats.bytes);
+        }
+    };
+}
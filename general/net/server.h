@@ -1,18 +1,70 @@
 #pragma once
 
 #include <thread>
-#include <random>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <optional>
+#include <string>
+#include <functional>
 
 #include <asio.hpp>
 
 #include "connection.h"
+#include "send_queue.h"
 #include "message.h"
+#include "link_model.h"
+#include "multicast.h"
+#include "local_network.h"
+#include "simulation.h"
+#if __has_include(<linux/io_uring.h>)
+#include "uring_transport.h"
+#define LATTICE_HAS_IO_URING 1
+#endif
 
 namespace net {
 
+    /**
+     * How @Server moves messages.
+     */
+    enum class Transport {
+        // asio sockets on the context threads
+        Asio,
+        // @UringTransport. Linux only
+        IoUring,
+        // @LocalNetwork. Servers of one process, nothing is bound to port
+        InMemory,
+        // @ISimulation given to @Server::set_simulation. No threads, virtual time
+        Simulated
+    };
+
+    /**
+     * Parse TCP transport name as given in LA_TRANSPORT
+     * @param value "asio" or "io_uring"
+     * @return transport
+     */
+    inline Transport parse_transport(const std::string &value) {
+        if (value == "asio") return Transport::Asio;
+        if (value == "io_uring") return Transport::IoUring;
+        LOG(ERROR) << "Unknown transport:" << value;
+        throw std::runtime_error("Unknown transport " + value);
+    }
+
     /**
      * TCP Server. Used by protocols to communicate with each other via sending @Message.
      * Leverages asio library for async TCP communication.
+     * Keeps one persistent @WriteConnection per peer, so messages to the same peer share one socket.
+     * Every message passes through @ILinkModel first. By default messages are sent without delay.
+     * Messages queued for the same peer are coalesced into batched frames, see @CoalescingOptions.
+     * Queue of every peer is bounded, see @SendQueueOptions, and send reports messages the queue rejected.
+     * Context runs on a pool of threads. Every outgoing connection has its own strand, and messages received over
+     * one connection are passed to callback one after another in the order they were sent, while messages from
+     * different connections may be handled in parallel. Callbacks should therefore be thread safe.
+     * Optionally broadcasts to the whole group go out once over UDP multicast, see @MulticastChannel.
+     * Frames are moved by asio sockets or, when selected, by @UringTransport. Build with LATTICE_IO_URING
+     * to make io_uring the default. Servers of one process may skip sockets altogether on @LocalNetwork.
      */
     struct Server : IMessageReceivedCallback {
 
@@ -22,68 +74,543 @@ namespace net {
          * @param port Listen port
          */
         Server(IMessageReceivedCallback *callback, uint64_t port)
-                : callback(callback),
-                  asio_acceptor(context,
-                                asio::ip::tcp::endpoint(
-                                        asio::ip::tcp::v4(),
-                                        port)) {}
+                : asio_acceptor(context),
+                  callback(callback),
+                  port(port) {}
 
         /**
          * Start server
          */
         void start() {
-            accept_connection();
-            context_thread = std::thread([&]() {
-                context.run();
-            });
+            if (transport == Transport::Simulated) {
+                simulation->attach(port, this);
+                return;
+            }
+            if (transport == Transport::InMemory) {
+                local = std::make_shared<LocalEndpoint>(context, this, io_threads == 1);
+                LocalNetwork::instance().attach(port, local);
+                work.emplace(asio::make_work_guard(context));
+            } else {
+                listen();
+            }
+            if (!multicast_options.group.empty()) {
+                multicast = std::make_unique<MulticastChannel>(context, multicast_options, this, max_frame_size);
+                multicast->start();
+            }
+#ifdef LATTICE_HAS_IO_URING
+            if (transport == Transport::IoUring) {
+                uring = std::make_unique<UringTransport>(asio_acceptor.native_handle(), this, max_frame_size,
+                                                         coalescing, send_queue);
+                uring->start();
+                // context runs only posted tasks and timers now, keep its threads until stop
+                work.emplace(asio::make_work_guard(context));
+            } else if (transport == Transport::Asio) {
+                accept_connection();
+            }
+#else
+            if (transport == Transport::Asio) {
+                accept_connection();
+            }
+#endif
+            for (uint64_t i = 0; i < io_threads; ++i) {
+                context_threads.emplace_back([&]() {
+                    context.run();
+                });
+            }
+            if (transport != Transport::InMemory) {
+                task_work.emplace(asio::make_work_guard(task_context));
+                task_thread = std::thread([&]() {
+                    task_context.run();
+                });
+            }
         }
 
         /**
-         * Stop server
+         * Stop server. Waits for posted tasks first
          */
         void stop() {
+            if (!context_threads.empty()) {
+                wait_tasks();
+            }
+            if (task_thread.joinable()) {
+                task_work.reset();
+                task_context.stop();
+                task_thread.join();
+            }
+            if (local) {
+                LocalNetwork::instance().detach(port);
+                local->close();
+            }
             context.stop();
-            if (context_thread.joinable()) context_thread.join();
+            for (auto &thread : context_threads) {
+                if (thread.joinable()) thread.join();
+            }
+#ifdef LATTICE_HAS_IO_URING
+            if (uring) {
+                uring->stop();
+            }
+#endif
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            for (auto &peer : peers) {
+                peer.second->close();
+            }
+            if (multicast) {
+                multicast->close();
+            }
+        }
+
+        /**
+         * Replace link model. Should be called before start
+         * @param model New link model
+         */
+        void set_link_model(std::unique_ptr<ILinkModel> model) {
+            std::lock_guard<std::mutex> lock(link_mutex);
+            link_model = std::move(model);
+            emulated_link = true;
+        }
+
+        /**
+         * Set number of threads running context. Should be called before start
+         * @param threads Number of threads. At least 1
+         */
+        void set_io_threads(uint64_t threads) {
+            io_threads = std::max<uint64_t>(threads, 1);
+        }
+
+        /**
+         * Set largest frame accepted from peers. Connections sending larger frames are closed. Should be called before start
+         * @param bytes Frame size limit
+         */
+        void set_max_frame_size(uint64_t bytes) {
+            max_frame_size = bytes;
+        }
+
+        /**
+         * Configure send side coalescing. Should be called before start
+         * @param options Flush window and batch size threshold
+         */
+        void set_coalescing(const CoalescingOptions &options) {
+            coalescing = options;
+        }
+
+        /**
+         * Configure bounds of queue of every peer. Should be called before start.
+         * Block policy waits only in threads other than the context threads, and such threads should not hold locks
+         * that message callbacks take, otherwise the writer may never get to empty the queue
+         * @param options Limits and overflow policy
+         */
+        void set_send_queue(const SendQueueOptions &options) {
+            send_queue = options;
+        }
+
+        /**
+         * Counters of queue of every peer messages were sent to. Messages on @LocalNetwork or simulated network
+         * are delivered without queue and are not counted
+         * @return peer and counters of its queue
+         */
+        std::vector<std::pair<ProcessDescriptor, SendQueueStats>> send_queue_stats() {
+#ifdef LATTICE_HAS_IO_URING
+            if (uring) {
+                return uring->send_queue_stats();
+            }
+#endif
+            std::vector<std::pair<ProcessDescriptor, SendQueueStats>> result;
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            for (const auto &peer : peers) {
+                result.emplace_back(peer.second->get_descriptor(), peer.second->stats());
+            }
+            return result;
         }
 
         /**
-         * Send message to process with delay
+         * Select transport. Should be called before start
+         * @param value Transport. IoUring is available only on Linux, InMemory reaches only servers of this process
+         */
+        void set_transport(Transport value) {
+#ifndef LATTICE_HAS_IO_URING
+            if (value == Transport::IoUring) {
+                LOG(ERROR) << "io_uring transport is not available";
+                throw std::runtime_error("io_uring transport is not available");
+            }
+#endif
+            transport = value;
+        }
+
+        /**
+         * Run on simulated network: messages and posted tasks become events of @value, and no thread is started.
+         * Should be called before start
+         * @param value Simulation. Outlives server
+         */
+        void set_simulation(ISimulation *value) {
+            simulation = value;
+            transport = Transport::Simulated;
+        }
+
+        /**
+         * Send broadcasts that reach every other process of the group over UDP multicast.
+         * Link model needs a decision per receiver, so broadcasts stay unicast when it is set.
+         * Should be called before start
+         * @param options Group configuration. Every process of the group should use the same group and port
+         */
+        void set_multicast(const MulticastOptions &options) {
+            multicast_options = options;
+        }
+
+        /**
+         * Send message to process. Link model decides whether message is dropped or delayed
          * @param descriptor Descriptor of receiver
          * @param message Message that will be sent
+         * @param key Message replaces message with the same key still queued for @descriptor, see @SendQueue
+         * @return false when queue of @descriptor rejected message
          */
-        void send(const ProcessDescriptor &descriptor, const Message &message) {
-            auto connection = std::make_shared<net::WriteConnection>(context,  descriptor, message);
-            uint64_t delay = (uint64_t)distribution(generator);
-            connection->timer.expires_from_now(std::chrono::milliseconds(delay));
-            connection->send();
+        bool send(const ProcessDescriptor &descriptor, const Message &message, uint64_t key = SendQueue::NO_KEY) {
+            return send(descriptor, std::make_shared<const Message>(message), key);
+        }
+
+        /**
+         * Send shared message to process. Buffer is not copied.
+         * Delayed messages wait for link model before they are queued, so their rejection is only counted
+         * @param descriptor Descriptor of receiver
+         * @param message Message that will be sent
+         * @param key Message replaces message with the same key still queued for @descriptor, see @SendQueue
+         * @return false when queue of @descriptor rejected message
+         */
+        bool send(const ProcessDescriptor &descriptor, SharedMessage message, uint64_t key = SendQueue::NO_KEY) {
+            return route(descriptor, std::move(message), key, std::nullopt);
+        }
+
+        /**
+         * Send message to process. While queue of @descriptor rejects it, message is queued again by a posted task
+         * after a delay that doubles with every attempt
+         * @param descriptor Descriptor of receiver
+         * @param message Message that will be sent
+         * @param key Message replaces message with the same key still queued for @descriptor, see @SendQueue
+         * @param needed Checked before every new attempt, message is given up once it returns false. Empty keeps
+         * sending until message is queued
+         */
+        void send_retrying(const ProcessDescriptor &descriptor, SharedMessage message,
+                           uint64_t key = SendQueue::NO_KEY, std::function<bool()> needed = {}) {
+            route(descriptor, std::move(message), key, Retry{std::move(needed)});
+        }
+
+        /**
+         * Copy message and send it like @send_retrying
+         */
+        void send_retrying(const ProcessDescriptor &descriptor, const Message &message,
+                           uint64_t key = SendQueue::NO_KEY, std::function<bool()> needed = {}) {
+            send_retrying(descriptor, std::make_shared<const Message>(message), key, std::move(needed));
+        }
+
+        /**
+         * Run task off the threads that handle messages. Used by protocols to serialize and send broadcasts without
+         * blocking caller. TCP servers run tasks one at a time in order on a thread of their own, where Block policy
+         * of send queues may wait. Servers on @LocalNetwork run them on context threads
+         * @param task Callable without arguments
+         */
+        template<typename F>
+        void post(F &&task) {
+            if (simulation) {
+                simulation->post(port, std::forward<F>(task));
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(tasks_mutex);
+                ++pending_tasks;
+            }
+            asio::post(transport == Transport::InMemory ? context : task_context,
+                       [this, task = std::forward<F>(task)]() mutable {
+                try {
+                    task();
+                } catch (const std::runtime_error &e) {
+                    LOG(ERROR) << "Exception in posted task:" << e.what();
+                }
+                std::lock_guard<std::mutex> lock(tasks_mutex);
+                if (--pending_tasks == 0) {
+                    tasks_done.notify_all();
+                }
+            });
+        }
+
+        /**
+         * Wait until every task passed to post finished
+         */
+        void wait_tasks() {
+            std::unique_lock<std::mutex> lock(tasks_mutex);
+            tasks_done.wait(lock, [&] { return pending_tasks == 0; });
+        }
+
+        /**
+         * Send message to every process. Message is serialized once and its buffer is shared by all connections.
+         * When receivers are every other process of multicast group, message is multicast once instead.
+         * @param descriptors Receivers by id
+         * @param message Message that will be sent
+         * @param except Id of process in @descriptors that does not receive message
+         * @param key Message replaces message with the same key still queued for a receiver, see @SendQueue
+         * @return false when queue of some receiver rejected message
+         */
+        bool broadcast(const std::unordered_map<uint64_t, ProcessDescriptor> &descriptors, Message message,
+                       uint64_t except = NO_PROCESS, uint64_t key = SendQueue::NO_KEY) {
+            return spread(descriptors, std::make_shared<const Message>(std::move(message)), except, key,
+                          std::nullopt);
+        }
+
+        /**
+         * Send message to every process like @broadcast, and send it again to every receiver whose queue rejected it
+         * like @send_retrying
+         * @param descriptors Receivers by id
+         * @param message Message that will be sent
+         * @param except Id of process in @descriptors that does not receive message
+         * @param key Message replaces message with the same key still queued for a receiver, see @SendQueue
+         * @param needed Checked before every new attempt, message is given up once it returns false
+         */
+        void broadcast_retrying(const std::unordered_map<uint64_t, ProcessDescriptor> &descriptors, Message message,
+                                uint64_t except = NO_PROCESS, uint64_t key = SendQueue::NO_KEY,
+                                std::function<bool()> needed = {}) {
+            spread(descriptors, std::make_shared<const Message>(std::move(message)), except, key,
+                   Retry{std::move(needed)});
         }
 
         void on_message_received(Message &message) override {
             callback->on_message_received(message);
         }
 
+        // id that matches no process
+        static constexpr uint64_t NO_PROCESS = UINT64_MAX;
+
     private:
         // asio context
         asio::io_context context;
-        // thread on witch asio context operates
-        std::thread context_thread;
+        // threads on which asio context operates
+        std::vector<std::thread> context_threads;
+        uint64_t io_threads = 1;
+
+        // posted tasks of TCP servers. They may wait for room in send queues, context threads may not
+        asio::io_context task_context;
+        std::thread task_thread;
+        std::optional<asio::executor_work_guard<asio::io_context::executor_type>> task_work;
+
+        // number of posted tasks that did not finish yet
+        uint64_t pending_tasks = 0;
+        std::mutex tasks_mutex;
+        std::condition_variable tasks_done;
         // asio acceptor
         asio::ip::tcp::acceptor asio_acceptor;
 
         // protocol callback
         IMessageReceivedCallback *callback;
 
-        // message delay
-        std::random_device dev;
-        std::default_random_engine generator{dev()};
-        std::normal_distribution<double> distribution{300, 30};
+        // listen port, or address on @LocalNetwork
+        uint64_t port;
+
+        // network emulation applied to sent messages
+        std::unique_ptr<ILinkModel> link_model = std::make_unique<ZeroDelayLink>();
+        std::mutex link_mutex;
+        bool emulated_link = false;
+
+        // group broadcasts are multicast to. Disabled when group is empty
+        MulticastOptions multicast_options;
+        std::unique_ptr<MulticastChannel> multicast;
+
+        // applied to connections opened after it is set
+        CoalescingOptions coalescing;
+        SendQueueOptions send_queue;
+        uint64_t max_frame_size = ReadConnection::DEFAULT_MAX_FRAME_SIZE;
+
+#ifdef LATTICE_IO_URING
+        Transport transport = Transport::IoUring;
+#else
+        Transport transport = Transport::Asio;
+#endif
+#ifdef LATTICE_HAS_IO_URING
+        std::unique_ptr<UringTransport> uring;
+#endif
+        // receiving side on @LocalNetwork
+        std::shared_ptr<LocalEndpoint> local;
+        ISimulation *simulation = nullptr;
+        std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work;
+
+        // persistent connections by peer address
+        std::unordered_map<std::string, std::shared_ptr<WriteConnection>> peers;
+        std::mutex peers_mutex;
+
+        /**
+         * Get connection to peer, opening it on first use
+         * @param descriptor Descriptor of peer
+         * @return connection to @descriptor
+         */
+        std::shared_ptr<WriteConnection> peer(const ProcessDescriptor &descriptor) {
+            std::string address = descriptor.ip_address + ":" + std::to_string(descriptor.port);
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto it = peers.find(address);
+            if (it == peers.end()) {
+                it = peers.emplace(address, std::make_shared<WriteConnection>(context, descriptor, coalescing,
+                                                                              send_queue)).first;
+            }
+            return it->second;
+        }
+
+
+        /**
+         * Send that is repeated while queue rejects message
+         */
+        struct Retry {
+            // message is given up once it returns false. Empty keeps sending
+            std::function<bool()> needed;
+            uint64_t attempt = 0;
+        };
+
+        // delay before first repeated send, doubled with every attempt up to 2^MAX_RETRY_SHIFT times
+        static constexpr std::chrono::milliseconds RETRY_DELAY{1};
+        static constexpr uint64_t MAX_RETRY_SHIFT = 10;
 
+        /**
+         * Pass message through link model and queue it for @descriptor
+         * @param retry Repeat send when queue rejects message. Empty only reports rejection
+         * @return false when queue of @descriptor rejected message
+         */
+        bool route(const ProcessDescriptor &descriptor, SharedMessage message, uint64_t key,
+                   std::optional<Retry> retry) {
+            LinkDecision decision;
+            {
+                std::lock_guard<std::mutex> lock(link_mutex);
+                decision = link_model->on_send(descriptor, message->get_size());
+            }
+            if (decision.drop) return true;
+            if (simulation) {
+                simulation->transmit(port, descriptor, std::move(message), decision.delay);
+                return true;
+            }
+            if (local) {
+                if (decision.delay.count() == 0) {
+                    send_local(descriptor, std::move(message));
+                    return true;
+                }
+                auto timer = std::make_shared<asio::steady_timer>(context, decision.delay);
+                timer->async_wait([this, timer, descriptor, message = std::move(message)](const asio::error_code &er) {
+                    if (!er) {
+                        send_local(descriptor, message);
+                    } else {
+                        LOG(ERROR) << "ERROR Waiting" << er.message();
+                    }
+                });
+                return true;
+            }
+            if (decision.delay.count() == 0) {
+                return enqueue(descriptor, std::move(message), key, std::move(retry));
+            }
+            auto timer = std::make_shared<asio::steady_timer>(context, decision.delay);
+            timer->async_wait([this, timer, descriptor, message = std::move(message), key,
+                               retry = std::move(retry)](const asio::error_code &er) mutable {
+                if (!er) {
+                    enqueue(descriptor, std::move(message), key, std::move(retry));
+                } else {
+                    LOG(ERROR) << "ERROR Waiting" << er.message();
+                }
+            });
+            return true;
+        }
+
+        /**
+         * Queue message for @descriptor on TCP transport, scheduling next attempt when it is rejected
+         * @return false when queue of @descriptor rejected message
+         */
+        bool enqueue(const ProcessDescriptor &descriptor, SharedMessage message, uint64_t key,
+                     std::optional<Retry> retry) {
+            bool accepted;
+#ifdef LATTICE_HAS_IO_URING
+            if (uring) {
+                accepted = uring->send(descriptor, message, key);
+            } else {
+                accepted = peer(descriptor)->send(message, key);
+            }
+#else
+            accepted = peer(descriptor)->send(message, key);
+#endif
+            if (!accepted && retry) {
+                retry_later(descriptor, std::move(message), key, std::move(*retry));
+            }
+            return accepted;
+        }
+
+        /**
+         * Queue rejected message again after a delay. Timer only posts the attempt, so it may wait for room
+         */
+        void retry_later(const ProcessDescriptor &descriptor, SharedMessage message, uint64_t key, Retry retry) {
+            auto delay = RETRY_DELAY * (1ull << std::min(retry.attempt, MAX_RETRY_SHIFT));
+            ++retry.attempt;
+            auto timer = std::make_shared<asio::steady_timer>(context, delay);
+            timer->async_wait([this, timer, descriptor, message = std::move(message), key,
+                               retry = std::move(retry)](const asio::error_code &er) mutable {
+                // server stopped
+                if (er) return;
+                post([this, descriptor, message = std::move(message), key, retry = std::move(retry)]() mutable {
+                    if (retry.needed && !retry.needed()) return;
+                    enqueue(descriptor, std::move(message), key, std::move(retry));
+                });
+            });
+        }
+
+        /**
+         * Send shared message to every process of @descriptors except @except, once over multicast when it covers them
+         * @return false when queue of some receiver rejected message
+         */
+        bool spread(const std::unordered_map<uint64_t, ProcessDescriptor> &descriptors, SharedMessage shared,
+                    uint64_t except, uint64_t key, const std::optional<Retry> &retry) {
+            if (multicast_covers(descriptors, except, shared->get_size())) {
+                multicast->send(shared);
+                auto self = descriptors.find(multicast_options.self);
+                if (self != descriptors.end() && self->first != except) {
+                    return route(self->second, shared, key, retry);
+                }
+                return true;
+            }
+            bool accepted = true;
+            for (const auto &descriptor : descriptors) {
+                if (descriptor.first == except) continue;
+                accepted &= route(descriptor.second, shared, key, retry);
+            }
+            return accepted;
+        }
+
+        /**
+         * @return true when multicast of @size bytes reaches every receiver of broadcast to @descriptors
+         */
+        bool multicast_covers(const std::unordered_map<uint64_t, ProcessDescriptor> &descriptors, uint64_t except,
+                              uint64_t size) const {
+            if (!multicast || emulated_link || size > multicast->max_message_size()) return false;
+            uint64_t others = 0;
+            for (const auto &descriptor : descriptors) {
+                others += descriptor.first != except && descriptor.first != multicast_options.self;
+            }
+            return others + 1 == multicast_options.group_size;
+        }
+
+        /**
+         * Pass message to server of @descriptor on @LocalNetwork. Messages to servers that are not running are lost
+         * silently, since stopped cluster nodes still get late responses
+         */
+        void send_local(const ProcessDescriptor &descriptor, SharedMessage message) {
+            if (auto target = LocalNetwork::instance().find(descriptor.port)) {
+                target->deliver(this, std::move(message));
+            }
+        }
+
+        /**
+         * Bind listen port
+         */
+        void listen() {
+            asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+            asio_acceptor.open(endpoint.protocol());
+            asio_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+            asio_acceptor.bind(endpoint);
+            asio_acceptor.listen();
+        }
 
         void accept_connection() {
             asio_acceptor.async_accept([&](std::error_code e, asio::ip::tcp::socket socket) {
                 accept_connection();
                 if (!e) {
-                    auto connection = std::make_shared<ReadConnection>(context, std::move(socket), this);
+                    auto connection = std::make_shared<ReadConnection>(context, std::move(socket), this, max_frame_size);
                     connection->receive();
                 } else {
                     throw std::runtime_error(e.message());
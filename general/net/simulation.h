@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+
+#include "message.h"
+#include "net_async.h"
+
+namespace net {
+
+    /**
+     * Discrete event loop that stands in for network and context threads of @Server.
+     * Servers are identified by port. Everything runs on the thread of the simulation, in virtual time.
+     */
+    struct ISimulation {
+        /**
+         * Register server, called from @Server::start
+         * @param port Port of server
+         * @param receiver Called when message for @port is delivered
+         */
+        virtual void attach(uint64_t port, IMessageReceivedCallback *receiver) = 0;
+
+        /**
+         * Deliver message after virtual delay
+         * @param from Port of sending server
+         * @param to Receiver
+         * @param message Message that was sent
+         * @param delay Delay decided by link model of sender
+         */
+        virtual void transmit(uint64_t from, const ProcessDescriptor &to, SharedMessage message,
+                              std::chrono::microseconds delay) = 0;
+
+        /**
+         * Run task after events already due at the current virtual time
+         * @param port Port of server that posts task
+         * @param task Callable without arguments
+         */
+        virtual void post(uint64_t port, std::function<void()> task) = 0;
+
+        virtual ~ISimulation() = default;
+    };
+}
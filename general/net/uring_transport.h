@@ -0,0 +1,635 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <limits.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "io_uring.h"
+#include "connection.h"
+
+namespace net {
+
+    /**
+     * TCP transport on io_uring, alternative to asio connections in @Server.
+     * Uses the same frames as @ReadConnection and @WriteConnection, so processes on different transports
+     * talk to each other: one persistent connection per peer, bounded @SendQueue per peer, queued messages
+     * coalesced into batched frames by @CoalescingOptions, reconnects with exponential delay.
+     * One thread owns the ring. Connections are accepted by a multishot accept, every inbound connection is read
+     * by a multishot receive into buffers of a registered buffer ring, and frames are parsed straight from them.
+     * Messages are written with one sendmsg per batch, gathering shared message buffers without copying.
+     * Operations of one loop iteration are submitted, and all completions reaped, with one io_uring_enter.
+     * Messages are passed to callback on the ring thread.
+     */
+    struct UringTransport {
+
+        // submission queue size
+        static constexpr unsigned RING_ENTRIES = 1024;
+        // provided buffer group used by receives
+        static constexpr uint16_t BUFFER_GROUP = 0;
+        static constexpr unsigned RECEIVE_BUFFERS = 128;
+        static_assert((RECEIVE_BUFFERS & (RECEIVE_BUFFERS - 1)) == 0 && RECEIVE_BUFFERS <= 32768);
+        static constexpr unsigned RECEIVE_BUFFER_SIZE = 64 * 1024;
+        // messages in one sendmsg. Every message takes two iovecs, batch header one more
+        static constexpr size_t MAX_BATCH_MESSAGES = (IOV_MAX - 1) / 2;
+
+        /**
+         * UringTransport constructor
+         * @param listen_fd listening socket. Owned by caller
+         * @param callback message received callback
+         * @param max_frame_size largest accepted frame in bytes
+         * @param options send side coalescing
+         * @param queue_options limits of queue of every peer
+         */
+        UringTransport(int listen_fd, IMessageReceivedCallback *callback, uint64_t max_frame_size,
+                       CoalescingOptions options, SendQueueOptions queue_options = {})
+                : listen_fd(listen_fd), callback(callback), max_frame_size(max_frame_size), options(options),
+                  queue_options(queue_options) {}
+
+        ~UringTransport() {
+            stop();
+        }
+
+        /**
+         * Start ring thread
+         */
+        void start() {
+            ring = std::make_unique<IoUring>(RING_ENTRIES);
+            buffers = std::make_unique<ProvidedBuffers>(*ring, BUFFER_GROUP, RECEIVE_BUFFERS, RECEIVE_BUFFER_SIZE);
+            wake_fd = eventfd(0, EFD_CLOEXEC);
+            if (wake_fd < 0) {
+                LOG(ERROR) << "Unable to create eventfd:" << std::strerror(errno);
+                throw std::runtime_error("Unable to create eventfd");
+            }
+            running = true;
+            thread = std::thread([this]() {
+                accept();
+                read_wake();
+                run();
+            });
+        }
+
+        /**
+         * Stop ring thread and close every connection. Queued messages are dropped
+         */
+        void stop() {
+            if (!thread.joinable()) return;
+            running = false;
+            wake();
+            thread.join();
+            for (auto &peer : peers) {
+                if (peer->fd >= 0) close(peer->fd);
+                peer->outbox->queue.drop(peer->batch);
+            }
+            {
+                std::lock_guard<std::mutex> lock(incoming_mutex);
+                for (auto &outbox : outboxes) {
+                    outbox.second->queue.close();
+                }
+                incoming.clear();
+            }
+            for (auto &inbound : inbounds) {
+                close(inbound.first);
+            }
+            // ring goes first, operations in flight point into peers and buffers
+            ring.reset();
+            buffers.reset();
+            peers.clear();
+            inbounds.clear();
+            close(wake_fd);
+        }
+
+        /**
+         * Queue message for peer. Thread safe
+         * @param descriptor Descriptor of receiver
+         * @param message Message that will be sent
+         * @param key Message replaces queued message with the same key, see @SendQueue
+         * @return false when queue rejected message
+         */
+        bool send(const ProcessDescriptor &descriptor, SharedMessage message, uint64_t key = SendQueue::NO_KEY) {
+            std::shared_ptr<Outbox> outbox = find_outbox(descriptor);
+            bool on_ring = std::this_thread::get_id() == thread.get_id();
+            // ring thread writes the queue, only other threads may wait for room
+            if (!outbox->queue.push(std::move(message), key, !on_ring)) return false;
+            if (outbox->woken.exchange(true)) return true;
+            bool was_empty;
+            {
+                std::lock_guard<std::mutex> lock(incoming_mutex);
+                was_empty = incoming.empty();
+                incoming.push_back(outbox);
+            }
+            // ring thread looks at woken queues before it waits again
+            if (was_empty && !on_ring) {
+                wake();
+            }
+            return true;
+        }
+
+        /**
+         * @return counters of queue of every peer messages were sent to. Thread safe
+         */
+        std::vector<std::pair<ProcessDescriptor, SendQueueStats>> send_queue_stats() {
+            std::vector<std::pair<ProcessDescriptor, SendQueueStats>> result;
+            std::lock_guard<std::mutex> lock(incoming_mutex);
+            for (const auto &outbox : outboxes) {
+                result.emplace_back(outbox.second->descriptor, outbox.second->queue.get_stats());
+            }
+            return result;
+        }
+
+    private:
+        // what completed operation was. Stored in top byte of user data, the rest is peer index or socket
+        enum Operation : uint64_t {
+            Wake = 0,
+            Accept = 1,
+            Receive = 2,
+            Connect = 3,
+            Send = 4,
+            Reconnect = 5,
+            Flush = 6
+        };
+
+        static constexpr uint64_t OPERATION_SHIFT = 56;
+
+        enum State {
+            Disconnected,
+            Connecting,
+            Connected
+        };
+
+        /**
+         * Queue of one peer, shared by sending threads and ring thread
+         */
+        struct Outbox {
+            ProcessDescriptor descriptor;
+            SendQueue queue;
+            // outbox is in incoming and ring thread did not take it yet
+            std::atomic<bool> woken = false;
+            // index of peer, set by ring thread on first wake up
+            size_t peer = SIZE_MAX;
+
+            Outbox(ProcessDescriptor descriptor, SendQueueOptions options)
+                    : descriptor(std::move(descriptor)), queue(options) {}
+        };
+
+        /**
+         * Outgoing connection. Same states and batching as @WriteConnection
+         */
+        struct Peer {
+            ProcessDescriptor descriptor;
+            std::shared_ptr<Outbox> outbox;
+            // position in peers, sent as user data
+            size_t index = 0;
+            sockaddr_storage address{};
+            socklen_t address_length = 0;
+            int fd = -1;
+            State state = Disconnected;
+            bool writing = false;
+            bool flush_scheduled = false;
+            uint64_t failed_attempts = 0;
+
+            // messages taken from queue for frame being written. Kept until written, resent after reconnect
+            std::vector<SharedMessage> batch;
+            // headers of frame being written. First is header of batched frame, then header of every message
+            std::vector<uint64_t> headers;
+            std::vector<iovec> iovecs;
+            // first iovec not completely written
+            size_t written_iovecs = 0;
+            msghdr msg{};
+            __kernel_timespec reconnect_delay{};
+            __kernel_timespec flush_delay{};
+        };
+
+        /**
+         * Incoming connection. Frame header and body are collected across receives
+         */
+        struct Inbound {
+            uint64_t header = 0;
+            size_t header_bytes = 0;
+            bool in_body = false;
+            bool batch = false;
+            uint64_t filled = 0;
+            // protocol error, rest of stream is ignored
+            bool broken = false;
+            Message message;
+            Message inner;
+        };
+
+        int listen_fd;
+        IMessageReceivedCallback *callback;
+        uint64_t max_frame_size;
+        CoalescingOptions options;
+        SendQueueOptions queue_options;
+
+        std::unique_ptr<IoUring> ring;
+        std::unique_ptr<ProvidedBuffers> buffers;
+        std::thread thread;
+        std::atomic<bool> running = false;
+
+        // queues by peer address
+        std::unordered_map<std::string, std::shared_ptr<Outbox>> outboxes;
+        // queues that got messages since ring thread looked at them
+        std::vector<std::shared_ptr<Outbox>> incoming;
+        // guards outboxes and incoming
+        std::mutex incoming_mutex;
+        int wake_fd = -1;
+        uint64_t wake_value = 0;
+
+        // used only from ring thread
+        std::vector<std::unique_ptr<Peer>> peers;
+        std::unordered_map<int, Inbound> inbounds;
+
+        static uint64_t user_data(Operation operation, uint64_t value) {
+            return (uint64_t) operation << OPERATION_SHIFT | value;
+        }
+
+        void wake() {
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) {
+                LOG(ERROR) << "Unable to wake ring thread:" << std::strerror(errno);
+            }
+        }
+
+        void run() {
+            std::vector<std::shared_ptr<Outbox>> taken;
+            while (running) {
+                {
+                    std::lock_guard<std::mutex> lock(incoming_mutex);
+                    taken.swap(incoming);
+                }
+                for (auto &outbox : taken) {
+                    outbox->woken = false;
+                    on_queued(peer(outbox));
+                }
+                taken.clear();
+                ring->submit(1);
+                ring->reap([this](const io_uring_cqe &cqe) {
+                    complete(cqe);
+                });
+                buffers->publish();
+            }
+        }
+
+        void complete(const io_uring_cqe &cqe) {
+            auto operation = (Operation) (cqe.user_data >> OPERATION_SHIFT);
+            uint64_t value = cqe.user_data & ((1ull << OPERATION_SHIFT) - 1);
+            switch (operation) {
+                case Wake:
+                    read_wake();
+                    break;
+                case Accept:
+                    on_accept(cqe);
+                    break;
+                case Receive:
+                    on_receive((int) value, cqe);
+                    break;
+                case Connect:
+                    on_connect(*peers[value], cqe.res);
+                    break;
+                case Send:
+                    on_send(*peers[value], cqe.res);
+                    break;
+                case Reconnect:
+                    connect(*peers[value]);
+                    break;
+                case Flush: {
+                    Peer &peer = *peers[value];
+                    if (peer.flush_scheduled) {
+                        peer.flush_scheduled = false;
+                        if (!peer.writing) {
+                            write_next(peer);
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+
+        void read_wake() {
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = wake_fd;
+            sqe->addr = (uint64_t) &wake_value;
+            sqe->len = sizeof(wake_value);
+            sqe->user_data = user_data(Wake, 0);
+        }
+
+        void accept() {
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = user_data(Accept, 0);
+        }
+
+        void receive(int fd) {
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUFFER_GROUP;
+            sqe->user_data = user_data(Receive, (uint64_t) fd);
+        }
+
+        void on_accept(const io_uring_cqe &cqe) {
+            if (cqe.res >= 0) {
+                inbounds.try_emplace(cqe.res);
+                receive(cqe.res);
+            } else {
+                LOG(ERROR) << "Error accepting connection:" << std::strerror(-cqe.res);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE) && running) {
+                accept();
+            }
+        }
+
+        void on_receive(int fd, const io_uring_cqe &cqe) {
+            auto it = inbounds.find(fd);
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                auto id = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res > 0 && it != inbounds.end()) {
+                    parse(fd, it->second, buffers->buffer(id), (size_t) cqe.res);
+                }
+                buffers->add(id);
+            }
+            if (cqe.flags & IORING_CQE_F_MORE) return;
+            if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+                // receive stopped, e.g. every buffer was taken. Parsed buffers go back before it is armed again
+                buffers->publish();
+                receive(fd);
+                return;
+            }
+            if (cqe.res < 0) {
+                LOG(ERROR) << "Error reading frame:" << std::strerror(-cqe.res);
+            }
+            close(fd);
+            inbounds.erase(fd);
+        }
+
+        /**
+         * Collects frames from received bytes and passes complete ones to callback
+         */
+        void parse(int fd, Inbound &in, const uint8_t *data, size_t len) {
+            while (!in.broken && (len > 0 || in.in_body)) {
+                if (!in.in_body) {
+                    size_t take = std::min(sizeof(in.header) - in.header_bytes, len);
+                    std::memcpy((uint8_t *) &in.header + in.header_bytes, data, take);
+                    in.header_bytes += take;
+                    data += take;
+                    len -= take;
+                    if (in.header_bytes < sizeof(in.header)) return;
+                    in.header_bytes = 0;
+
+                    Message &message = in.message;
+                    uint64_t size = in.header & FRAME_SIZE_MASK;
+                    if (!frame_encoding(in.header, message.encoding) || size > max_frame_size) {
+                        LOG(ERROR) << "Invalid frame header" << in.header << "limit" << max_frame_size;
+                        in.broken = true;
+                        shutdown(fd, SHUT_RDWR);
+                        return;
+                    }
+                    in.batch = in.header & BATCH_FRAME_FLAG;
+                    message.cur_pos = 0;
+                    message.size = size;
+                    message.data.clear();
+                    message.reserve(size);
+                    message.data.resize(size);
+                    in.filled = 0;
+                    in.in_body = true;
+                }
+                Message &message = in.message;
+                size_t take = std::min<uint64_t>(message.size - in.filled, len);
+                if (take > 0) {
+                    std::memcpy(message.data.data() + in.filled, data, take);
+                }
+                in.filled += take;
+                data += take;
+                len -= take;
+                if (in.filled < message.size) return;
+                in.in_body = false;
+                try {
+                    dispatch_frame(in.message, in.inner, in.batch, callback);
+                } catch (const std::runtime_error &e) {
+                    LOG(ERROR) << "Exception while handling message:" << e.what();
+                }
+            }
+        }
+
+        std::shared_ptr<Outbox> find_outbox(const ProcessDescriptor &descriptor) {
+            std::string address = descriptor.ip_address + ":" + std::to_string(descriptor.port);
+            std::lock_guard<std::mutex> lock(incoming_mutex);
+            auto &outbox = outboxes[address];
+            if (!outbox) {
+                outbox = std::make_shared<Outbox>(descriptor, queue_options);
+            }
+            return outbox;
+        }
+
+        Peer &peer(const std::shared_ptr<Outbox> &outbox) {
+            if (outbox->peer == SIZE_MAX) {
+                outbox->peer = peers.size();
+                peers.push_back(std::make_unique<Peer>());
+                peers.back()->descriptor = outbox->descriptor;
+                peers.back()->outbox = outbox;
+                peers.back()->index = outbox->peer;
+            }
+            return *peers[outbox->peer];
+        }
+
+        void on_queued(Peer &peer) {
+            if (peer.state == Connected && !peer.writing) {
+                schedule_flush(peer);
+            } else if (peer.state == Disconnected) {
+                connect(peer);
+            }
+        }
+
+        /**
+         * Write queued messages now when batch is full or no flush window is set, otherwise after flush window
+         */
+        void schedule_flush(Peer &peer) {
+            if (options.flush_window.count() == 0 || peer.outbox->queue.queued_bytes() >= options.max_batch_bytes) {
+                peer.flush_scheduled = false;
+                write_next(peer);
+                return;
+            }
+            if (peer.flush_scheduled) return;
+            peer.flush_scheduled = true;
+            auto window = std::chrono::duration_cast<std::chrono::nanoseconds>(options.flush_window).count();
+            peer.flush_delay.tv_sec = window / 1000000000;
+            peer.flush_delay.tv_nsec = window % 1000000000;
+            timeout(Flush, peer, peer.flush_delay);
+        }
+
+        void timeout(Operation operation, const Peer &peer, __kernel_timespec &delay) {
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t) &delay;
+            sqe->len = 1;
+            sqe->user_data = user_data(operation, peer.index);
+        }
+
+        bool resolve(Peer &peer) {
+            if (peer.address_length > 0) return true;
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *result = nullptr;
+            int error = getaddrinfo(peer.descriptor.ip_address.c_str(), std::to_string(peer.descriptor.port).c_str(),
+                                    &hints, &result);
+            if (error != 0 || result == nullptr) {
+                LOG(ERROR) << "Unable to resolve:" << gai_strerror(error);
+                return false;
+            }
+            std::memcpy(&peer.address, result->ai_addr, result->ai_addrlen);
+            peer.address_length = result->ai_addrlen;
+            freeaddrinfo(result);
+            return true;
+        }
+
+        void connect(Peer &peer) {
+            if (!running) return;
+            peer.state = Connecting;
+            if (!resolve(peer)) {
+                on_failure(peer);
+                return;
+            }
+            peer.fd = socket(peer.address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (peer.fd < 0) {
+                LOG(ERROR) << "Unable to open socket:" << std::strerror(errno);
+                on_failure(peer);
+                return;
+            }
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd = peer.fd;
+            sqe->addr = (uint64_t) &peer.address;
+            sqe->off = peer.address_length;
+            sqe->user_data = user_data(Connect, peer.index);
+        }
+
+        void on_connect(Peer &peer, int result) {
+            if (result < 0) {
+                LOG(ERROR) << "Unable to connect:" << std::strerror(-result);
+                on_failure(peer);
+                return;
+            }
+            peer.state = Connected;
+            peer.failed_attempts = 0;
+            int one = 1;
+            setsockopt(peer.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            write_next(peer);
+        }
+
+        void write_next(Peer &peer) {
+            if (peer.state != Connected) {
+                peer.writing = false;
+                return;
+            }
+            // batch left by failed send goes first
+            if (peer.batch.empty()) {
+                peer.outbox->queue.take(peer.batch, options.max_batch_bytes, MAX_BATCH_MESSAGES);
+            }
+            if (peer.batch.empty()) {
+                peer.writing = false;
+                return;
+            }
+            peer.writing = true;
+            uint64_t batch_bytes = 0;
+            for (const auto &message : peer.batch) {
+                batch_bytes += sizeof(uint64_t) + message->size;
+            }
+            // iovecs point into headers, so it is sized before they are taken
+            peer.headers.resize(peer.batch.size() + 1);
+            peer.iovecs.clear();
+            if (peer.batch.size() > 1) {
+                // batch payload keeps header of every message
+                peer.headers[0] = BATCH_FRAME_FLAG | batch_bytes;
+                peer.iovecs.push_back({&peer.headers[0], sizeof(uint64_t)});
+            }
+            for (size_t i = 0; i < peer.batch.size(); ++i) {
+                const Message &message = *peer.batch[i];
+                peer.headers[i + 1] = frame_header(message);
+                peer.iovecs.push_back({&peer.headers[i + 1], sizeof(uint64_t)});
+                if (message.size > 0) {
+                    peer.iovecs.push_back({(void *) message.data.data(), message.size});
+                }
+            }
+            peer.written_iovecs = 0;
+            submit_send(peer);
+        }
+
+        void submit_send(Peer &peer) {
+            peer.msg = {};
+            peer.msg.msg_iov = peer.iovecs.data() + peer.written_iovecs;
+            peer.msg.msg_iovlen = peer.iovecs.size() - peer.written_iovecs;
+            io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = peer.fd;
+            sqe->addr = (uint64_t) &peer.msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = user_data(Send, peer.index);
+        }
+
+        void on_send(Peer &peer, int result) {
+            if (result < 0) {
+                LOG(ERROR) << "Error writing message:" << std::strerror(-result);
+                peer.writing = false;
+                on_failure(peer);
+                return;
+            }
+            // skip what was written and send the rest
+            auto written = (size_t) result;
+            while (peer.written_iovecs < peer.iovecs.size() && written >= peer.iovecs[peer.written_iovecs].iov_len) {
+                written -= peer.iovecs[peer.written_iovecs++].iov_len;
+            }
+            if (peer.written_iovecs < peer.iovecs.size()) {
+                iovec &rest = peer.iovecs[peer.written_iovecs];
+                rest.iov_base = (uint8_t *) rest.iov_base + written;
+                rest.iov_len -= written;
+                submit_send(peer);
+                return;
+            }
+            peer.outbox->queue.complete(peer.batch);
+            peer.batch.clear();
+            write_next(peer);
+        }
+
+        /**
+         * Close socket and reconnect later. Messages being written stay in batch and are sent again.
+         */
+        void on_failure(Peer &peer) {
+            if (peer.fd >= 0) {
+                close(peer.fd);
+                peer.fd = -1;
+            }
+            peer.state = Disconnected;
+            if (++peer.failed_attempts >= WriteConnection::MAX_CONNECT_ATTEMPTS) {
+                uint64_t dropped = peer.outbox->queue.drop(peer.batch);
+                LOG(ERROR) << "Peer" << peer.descriptor.id << "unreachable. Dropped" << dropped << "messages";
+                peer.failed_attempts = 0;
+                return;
+            }
+            if (peer.batch.empty() && peer.outbox->queue.empty()) return;
+            peer.state = Connecting;
+            uint64_t delay = WriteConnection::RECONNECT_DELAY_MS << (peer.failed_attempts - 1);
+            peer.reconnect_delay.tv_sec = (int64_t) (delay / 1000);
+            peer.reconnect_delay.tv_nsec = (int64_t) (delay % 1000) * 1000000;
+            timeout(Reconnect, peer, peer.reconnect_delay);
+        }
+    };
+}
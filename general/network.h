@@ -9,6 +9,7 @@
 #include <condition_variable>
 
 #include "general/logger.h"
+#include "general/net/message.h"
 
 struct ProcessDescriptor {
     std::string ip_address;
@@ -73,24 +74,24 @@ std::string read_string(int client_fd) {
     return s;
 }
 
-template<typename L>
+template<Lattice L>
 L read_lattice(int client_fd) {
-    L res;
     uint64_t size = read_number(client_fd);
-    std::vector<uint64_t> data(size);
+    net::Message message;
+    message.data.resize(size);
+    message.size = size;
     size_t bytes_read = 0;
 
-    while (bytes_read != size * 8) {
-        ssize_t len = read(client_fd, (char*)(data.data()) + bytes_read, 8 * size - bytes_read);
+    while (bytes_read != size) {
+        ssize_t len = read(client_fd, message.data.data() + bytes_read, size - bytes_read);
         if (len <= 0) {
             LOG(ERROR) << "Error reading lattice" << errno;
             throw std::runtime_error("Error reading number: " + std::to_string(len));
         }
         bytes_read += len;
     }
-    for (uint64_t i = 0; i < size; ++i) {
-        res.insert(data[i]);
-    }
+    L res;
+    message >> res;
     return res;
 }
 
@@ -169,11 +170,19 @@ void send_string(int sock, const std::string &s) {
     }
 }
 
-template<typename L>
+template<Lattice L>
 void send_lattice(int sock, const L &lattice) {
-    send_number(sock, lattice.set.size());
-    for (uint64_t elem : lattice.set) {
-        send_number(sock, elem);
+    net::Message message;
+    message << lattice;
+    send_number(sock, message.get_size());
+    size_t bytes_sent = 0;
+    while (bytes_sent != message.get_size()) {
+        ssize_t len = send(sock, message.get_data() + bytes_sent, message.get_size() - bytes_sent, 0);
+        if (len <= 0) {
+            LOG(ERROR) << "Error sending lattice:" << errno;
+            throw std::runtime_error("Error sending lattice: " + std::to_string(len));
+        }
+        bytes_sent += len;
     }
 }
 
@@ -59,7 +59,7 @@ struct Generalizer : GeneralizedLA<L>, CallbackGeneralizer<L> {
             for (auto elem: Ip) {
                 auto i_cur = std::get<1>(elem);
                 auto j_cur = std::get<2>(elem);
-                prop = L::join(prop, v[i_cur][j_cur]);
+                prop.join_into(v[i_cur][j_cur]);
             }
             ap = la_gen.propose_to(l + 1, prop);
         }
@@ -79,7 +79,7 @@ struct Generalizer : GeneralizedLA<L>, CallbackGeneralizer<L> {
 
     void receive_prepare(uint64_t i, uint64_t j_rec, uint64_t rp) override {
         r[i][j_rec].insert(rp);
-        if (r[i][j_rec].size() == N - f && v[i][j_rec].set.empty()) {
+        if (r[i][j_rec].size() == N - f && v[i][j_rec].empty()) {
             protocol.send_pre_sched(i, j_rec, *r[i][j_rec].rbegin());
         }
     }
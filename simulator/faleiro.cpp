@@ -0,0 +1,82 @@
+#include <string>
+
+#include "faleiro/acceptor.h"
+#include "faleiro/proposer.h"
+#include "cluster/local_cluster.h"
+#include "simulator.h"
+
+/**
+ * Faleiro process of @Simulator. Proposes set of its id, as in coordinator runs.
+ * Driver does what Proposer::start does on every wake up: decide, or refine when not decided
+ */
+struct FaleiroNode {
+    FaleiroNode(uint64_t id, uint64_t n, uint64_t, const std::vector<net::ProcessDescriptor> &peers,
+                const SimulationOptions &options)
+            : protocol(peers[id].port, id, options.delta), acceptor(protocol), proposer(protocol, id, n) {
+        for (const auto &peer : peers) {
+            protocol.add_process(peer);
+        }
+        initial_value.insert(id);
+    }
+
+    net::Server &server() {
+        return protocol.server;
+    }
+
+    void start() {
+        protocol.start(&acceptor, &proposer);
+    }
+
+    void propose() {
+        proposer.propose(initial_value);
+    }
+
+    bool step() {
+        if (decided) return true;
+        if (auto value = proposer.decide()) {
+            result = *value;
+            decided = true;
+            return true;
+        }
+        proposer.refine();
+        return false;
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    FaleiroProtocol<LatticeSet> protocol;
+    Acceptor<LatticeSet> acceptor;
+    Proposer<LatticeSet> proposer;
+    LatticeSet initial_value;
+    LatticeSet result;
+    bool decided = false;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        LOG(ERROR) << "usage: n f [--seed S] [--latency MS] [--jitter MS] [--link-model FILE] [--max-virtual-ms MS]"
+                      " [--delta] [--per-node]";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    auto options = SimulationOptions::parse(argc, argv, 3);
+    LOG::set_level(ERROR);
+
+    Simulator<FaleiroNode> simulator(n, f, options);
+    simulator.run();
+    simulator.report();
+
+    std::vector<LatticeSet> values;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (simulator.node(i).decided) {
+            values.push_back(simulator.node(i).result);
+        }
+    }
+    if (!is_chain(values)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
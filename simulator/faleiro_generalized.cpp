@@ -0,0 +1,111 @@
+#include <string>
+
+#include "faleiro_generalized/acceptor.h"
+#include "faleiro_generalized/proposer.h"
+#include "faleiro_generalized/learner.h"
+#include "cluster/local_cluster.h"
+#include "simulator.h"
+
+/**
+ * Generalized Faleiro process of @Simulator. Learns n values, value i of process id is set of i * n + id,
+ * as in coordinator runs. For every value driver does what the main loop does: receive_value, then
+ * Proposer::start until decided, then Learner::learn_value until the value is learnt
+ */
+struct FaleiroGeneralizedNode {
+    FaleiroGeneralizedNode(uint64_t id, uint64_t n, uint64_t, const std::vector<net::ProcessDescriptor> &peers,
+                           const SimulationOptions &options)
+            : protocol(peers[id].port, id, options.delta), acceptor(protocol), proposer(protocol, id, n),
+              learner(protocol, n), initial_value(n) {
+        for (const auto &peer : peers) {
+            protocol.add_process(peer);
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            initial_value[i].insert(i * n + id);
+        }
+    }
+
+    net::Server &server() {
+        return protocol.server;
+    }
+
+    void start() {
+        protocol.start(&acceptor, &proposer, &learner);
+    }
+
+    void propose() {
+        begin_value();
+    }
+
+    bool step() {
+        while (results.size() < initial_value.size()) {
+            if (proposing) {
+                if (!proposer.decide()) {
+                    proposer.refine();
+                    return false;
+                }
+                proposing = false;
+            }
+            const LatticeSet &value = initial_value[results.size()];
+            if (!(value <= learner.learnt_value)) return false;
+            results.push_back(learner.learnt_value);
+            if (results.size() < initial_value.size()) {
+                begin_value();
+            }
+        }
+        return true;
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    FaleiroProtocol<LatticeSet> protocol;
+    Acceptor<LatticeSet> acceptor;
+    Proposer<LatticeSet> proposer;
+    Learner<LatticeSet> learner;
+    std::vector<LatticeSet> initial_value;
+    std::vector<LatticeSet> results;
+
+private:
+    // proposer has not decided on current value yet
+    bool proposing = false;
+
+    void begin_value() {
+        proposer.receive_value(initial_value[results.size()]);
+        proposer.propose();
+        proposing = true;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        LOG(ERROR) << "usage: n f [--seed S] [--latency MS] [--jitter MS] [--link-model FILE] [--max-virtual-ms MS]"
+                      " [--delta] [--per-node]";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    auto options = SimulationOptions::parse(argc, argv, 3);
+    LOG::set_level(ERROR);
+
+    Simulator<FaleiroGeneralizedNode> simulator(n, f, options);
+    simulator.run();
+    simulator.report();
+
+    bool valid = true;
+    std::vector<LatticeSet> all_learnt;
+    for (uint64_t id = 0; id < n; ++id) {
+        const auto &node = simulator.node(id);
+        for (size_t i = 0; i < node.results.size(); ++i) {
+            if (!(node.initial_value[i] <= node.results[i]) || (i > 0 && !(node.results[i - 1] <= node.results[i]))) {
+                LOG(ERROR) << "Invalid results of" << id;
+                valid = false;
+            }
+            all_learnt.push_back(node.results[i]);
+        }
+    }
+    if (!valid || !is_chain(all_learnt)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
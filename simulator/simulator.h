@@ -0,0 +1,332 @@
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include "general/logger.h"
+#include "general/net/server.h"
+#include "general/net/simulation.h"
+#include "general/net/link_model.h"
+
+/**
+ * Parameters of @Simulator run. Runs with the same options and binary are identical
+ */
+struct SimulationOptions {
+    // seed of link models of all nodes
+    uint64_t seed = 1;
+    // one way latency and standard deviation of its normal jitter, used when no link model file is given
+    double latency_ms = 1;
+    double jitter_ms = 0.1;
+    // rules of net::EmulatedLink applied to every node instead of latency and jitter
+    std::string link_model;
+    // events after this virtual time are not processed
+    uint64_t max_virtual_us = 3600ull * 1000 * 1000;
+    // proposals and nacks of Faleiro protocols carry deltas
+    bool delta = false;
+    // print statistics of every node
+    bool per_node = false;
+
+    /**
+     * Parse options from command line
+     * "[--seed S] [--latency MS] [--jitter MS] [--link-model FILE] [--max-virtual-ms MS] [--delta] [--per-node]"
+     * @param argc number of arguments
+     * @param argv arguments
+     * @param first index of first option
+     * @return parsed options
+     */
+    static SimulationOptions parse(int argc, char *argv[], int first) {
+        SimulationOptions options;
+        for (int i = first; i < argc; ++i) {
+            std::string name = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    LOG(ERROR) << "Missing value of" << name;
+                    throw std::runtime_error("Missing value of " + name);
+                }
+                return argv[++i];
+            };
+            if (name == "--seed") {
+                options.seed = std::stoull(value());
+            } else if (name == "--latency") {
+                options.latency_ms = std::stod(value());
+            } else if (name == "--jitter") {
+                options.jitter_ms = std::stod(value());
+            } else if (name == "--link-model") {
+                options.link_model = value();
+            } else if (name == "--max-virtual-ms") {
+                options.max_virtual_us = std::stoull(value()) * 1000;
+            } else if (name == "--delta") {
+                options.delta = true;
+            } else if (name == "--per-node") {
+                options.per_node = true;
+            } else {
+                LOG(ERROR) << "Unknown option" << name;
+                throw std::runtime_error("Unknown option " + name);
+            }
+        }
+        return options;
+    }
+};
+
+/**
+ * What one node did during simulation.
+ */
+struct NodeStats {
+    uint64_t messages_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t messages_received = 0;
+    uint64_t bytes_received = 0;
+    // longest chain of messages that led to the last event of node
+    uint64_t depth = 0;
+    bool decided = false;
+    uint64_t decision_time_us = 0;
+    // depth when node decided, i.e. message delays the decision took
+    uint64_t decision_rounds = 0;
+};
+
+/**
+ * Single threaded discrete event simulation of n nodes of one protocol. Servers of nodes run on
+ * @net::Transport::Simulated: every message and posted task is an event, and events are processed in order of
+ * virtual time, then of creation. Delays come from a seeded @net::EmulatedLink per node on virtual clock,
+ * so a run depends only on its options.
+ * Blocking start() of protocols can not run on one thread, so every node has a driver that does the same steps:
+ * step() is called after every event of the node, like start() wakes on every notification.
+ * @tparam Node One process of protocol with driver. Constructed as Node(id, n, f, peers, options), has server()
+ * returning its @net::Server, start() to start protocol, propose() to begin at virtual time 0, and step()
+ * returning true once node decided
+ */
+template<typename Node>
+struct Simulator : net::ISimulation {
+
+    // port of node 0. Node i has port FIRST_PORT + i
+    static constexpr uint64_t FIRST_PORT = 1;
+
+    /**
+     * Create and start every node
+     * @param n Number of nodes
+     * @param f Number of failures tolerated
+     * @param options Simulation parameters
+     */
+    Simulator(uint64_t n, uint64_t f, const SimulationOptions &options)
+            : n(n), options(options), stats(n), receivers(n, nullptr) {
+        for (uint64_t i = 0; i < n; ++i) {
+            peers.push_back({"simulated", i, FIRST_PORT + i});
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            nodes.push_back(std::make_unique<Node>(i, n, f, peers, options));
+            nodes[i]->server().set_simulation(this);
+            nodes[i]->server().set_link_model(link_model(i));
+            nodes[i]->start();
+        }
+    }
+
+    /**
+     * Let every node propose and process events until none is left
+     */
+    void run() {
+        auto cpu_begin = cpu_time();
+        for (uint64_t i = 0; i < n; ++i) {
+            nodes[i]->propose();
+            check(i);
+        }
+        while (!events.empty()) {
+            auto item = events.extract(events.begin());
+            if (item.key().first > options.max_virtual_us) break;
+            now = item.key().first;
+            Event &event = item.mapped();
+            NodeStats &node = stats[event.node];
+            node.depth = std::max(node.depth, event.depth);
+            if (event.message) {
+                ++node.messages_received;
+                node.bytes_received += event.message->get_size();
+                digest = mix(mix(mix(digest, now), event.node), event.message->get_size());
+                net::Message copy(*event.message);
+                copy.cur_pos = 0;
+                try {
+                    receivers[event.node]->on_message_received(copy);
+                } catch (const std::runtime_error &e) {
+                    LOG(ERROR) << "Error handling simulated message:" << e.what();
+                }
+            } else {
+                event.task();
+            }
+            check(event.node);
+            ++processed;
+        }
+        cpu_seconds = cpu_time() - cpu_begin;
+    }
+
+    /**
+     * Print summary of run, and statistics of every node when asked
+     */
+    void report() const {
+        uint64_t decided = 0;
+        uint64_t max_time = 0;
+        uint64_t total_time = 0;
+        uint64_t max_rounds = 0;
+        uint64_t total_rounds = 0;
+        NodeStats total;
+        for (const auto &node : stats) {
+            if (node.decided) {
+                ++decided;
+                max_time = std::max(max_time, node.decision_time_us);
+                total_time += node.decision_time_us;
+                max_rounds = std::max(max_rounds, node.decision_rounds);
+                total_rounds += node.decision_rounds;
+            }
+            total.messages_sent += node.messages_sent;
+            total.bytes_sent += node.bytes_sent;
+            total.messages_received += node.messages_received;
+            total.bytes_received += node.bytes_received;
+        }
+        double simulated_seconds = (double) now / 1e6;
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << "Nodes: " << n << '\n';
+        std::cout << "Decided: " << decided << '\n';
+        std::cout << "Decision virtual ms average: " << average(total_time, decided) / 1e3
+                  << " max: " << (double) max_time / 1e3 << '\n';
+        std::cout << "Decision rounds average: " << average(total_rounds, decided)
+                  << " max: " << max_rounds << '\n';
+        std::cout << "Messages per node sent: " << average(total.messages_sent, n)
+                  << " received: " << average(total.messages_received, n) << '\n';
+        std::cout << "Bytes per node sent: " << average(total.bytes_sent, n)
+                  << " received: " << average(total.bytes_received, n) << '\n';
+        std::cout << "Events: " << processed << '\n';
+        std::cout << "Simulated seconds: " << simulated_seconds << '\n';
+        std::cout << "CPU seconds: " << cpu_seconds << '\n';
+        std::cout << "CPU seconds per simulated second: "
+                  << (simulated_seconds > 0 ? cpu_seconds / simulated_seconds : 0.) << '\n';
+        std::cout << "Trace digest: " << std::hex << digest << std::dec << '\n';
+        if (options.per_node) {
+            for (uint64_t i = 0; i < n; ++i) {
+                const NodeStats &node = stats[i];
+                std::cout << "Node " << i << " decided: " << node.decided
+                          << " virtual ms: " << (double) node.decision_time_us / 1e3
+                          << " rounds: " << node.decision_rounds
+                          << " sent: " << node.messages_sent << ' ' << node.bytes_sent
+                          << " received: " << node.messages_received << ' ' << node.bytes_received << '\n';
+            }
+        }
+        std::cout.flush();
+    }
+
+    /**
+     * @return node @id
+     */
+    Node &node(uint64_t id) {
+        return *nodes[id];
+    }
+
+    /**
+     * @return statistics of node @id
+     */
+    const NodeStats &node_stats(uint64_t id) const {
+        return stats[id];
+    }
+
+    void attach(uint64_t port, net::IMessageReceivedCallback *receiver) override {
+        receivers.at(port - FIRST_PORT) = receiver;
+    }
+
+    void transmit(uint64_t from, const net::ProcessDescriptor &to, net::SharedMessage message,
+                  std::chrono::microseconds delay) override {
+        NodeStats &sender = stats[from - FIRST_PORT];
+        ++sender.messages_sent;
+        sender.bytes_sent += message->get_size();
+        if (to.port < FIRST_PORT || to.port - FIRST_PORT >= n) return;
+        schedule(now + delay.count(), to.port - FIRST_PORT, sender.depth + 1, std::move(message), {});
+    }
+
+    void post(uint64_t port, std::function<void()> task) override {
+        uint64_t node = port - FIRST_PORT;
+        schedule(now, node, stats[node].depth, nullptr, std::move(task));
+    }
+
+private:
+    struct Event {
+        uint64_t node;
+        uint64_t depth;
+        // message delivered to node, or task run when null
+        net::SharedMessage message;
+        std::function<void()> task;
+    };
+
+    uint64_t n;
+    SimulationOptions options;
+    std::vector<net::ProcessDescriptor> peers;
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::vector<NodeStats> stats;
+    std::vector<net::IMessageReceivedCallback *> receivers;
+
+    // pending events by virtual time and creation order
+    std::map<std::pair<uint64_t, uint64_t>, Event> events;
+    uint64_t sequence = 0;
+    // virtual time in microseconds
+    uint64_t now = 0;
+    uint64_t processed = 0;
+    double cpu_seconds = 0;
+    // hash of every delivery. Equal digests mean equal runs
+    uint64_t digest = 14695981039346656037ull;
+
+    void schedule(uint64_t time, uint64_t node, uint64_t depth, net::SharedMessage message,
+                  std::function<void()> task) {
+        events.emplace(std::pair{time, sequence++}, Event{node, depth, std::move(message), std::move(task)});
+    }
+
+    void check(uint64_t id) {
+        NodeStats &node = stats[id];
+        if (!node.decided && nodes[id]->step()) {
+            node.decided = true;
+            node.decision_time_us = now;
+            node.decision_rounds = node.depth;
+        }
+    }
+
+    std::unique_ptr<net::EmulatedLink> link_model(uint64_t id) {
+        // seed 0 would take random device
+        uint64_t seed = mix(options.seed, id) | 1;
+        std::unique_ptr<net::EmulatedLink> model;
+        if (!options.link_model.empty()) {
+            model = net::EmulatedLink::load(options.link_model, id, seed);
+        } else {
+            model = std::make_unique<net::EmulatedLink>(id, seed);
+            net::LinkParams params;
+            params.latency_ms = options.latency_ms;
+            params.jitter_ms = options.jitter_ms;
+            model->set(net::EmulatedLink::ANY, net::EmulatedLink::ANY, params);
+        }
+        model->set_clock([this]() {
+            return std::chrono::steady_clock::time_point(std::chrono::microseconds(now));
+        });
+        return model;
+    }
+
+    // FNV-1a step over 8 bytes of value
+    static uint64_t mix(uint64_t hash, uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= (value >> (8 * i)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static double average(uint64_t total, uint64_t count) {
+        return count ? (double) total / (double) count : 0.;
+    }
+
+    static double cpu_time() {
+        timespec time{};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+        return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+    }
+};
@@ -0,0 +1,80 @@
+#include <string>
+
+#include "zheng/zheng_la.h"
+#include "cluster/local_cluster.h"
+#include "simulator.h"
+
+/**
+ * Zheng process of @Simulator. Proposes set of its id, as in coordinator runs.
+ * Driver does what ZhengLA::start does on every wake up: step through the stages whose quorum was reached
+ */
+struct ZhengNode {
+    ZhengNode(uint64_t id, uint64_t n, uint64_t f, const std::vector<net::ProcessDescriptor> &peers,
+              const SimulationOptions &)
+            : protocol(peers[id].port, id), la(f, n, id, protocol) {
+        for (const auto &peer : peers) {
+            if (peer.id != id) {
+                protocol.add_process(peer);
+            }
+        }
+        initial_value.insert(id);
+    }
+
+    net::Server &server() {
+        return protocol.server;
+    }
+
+    void start() {
+        protocol.start(&la);
+    }
+
+    void propose() {
+        std::lock_guard<std::mutex> lock(la.cv_m);
+        la.propose(initial_value);
+    }
+
+    bool step() {
+        std::lock_guard<std::mutex> lock(la.cv_m);
+        if (auto value = la.step()) {
+            result = *value;
+            return true;
+        }
+        return false;
+    }
+
+    void stop() {
+        protocol.stop();
+    }
+
+    ProtocolTcp<LatticeSet> protocol;
+    ZhengLA<LatticeSet> la;
+    LatticeSet initial_value;
+    LatticeSet result;
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        LOG(ERROR) << "usage: n f [--seed S] [--latency MS] [--jitter MS] [--link-model FILE] [--max-virtual-ms MS]"
+                      " [--per-node]";
+        throw std::runtime_error("usage");
+    }
+    uint64_t n = std::stoull(argv[1]);
+    uint64_t f = std::stoull(argv[2]);
+    auto options = SimulationOptions::parse(argc, argv, 3);
+    LOG::set_level(ERROR);
+
+    Simulator<ZhengNode> simulator(n, f, options);
+    simulator.run();
+    simulator.report();
+
+    std::vector<LatticeSet> values;
+    for (uint64_t i = 0; i < n; ++i) {
+        if (simulator.node_stats(i).decided) {
+            values.push_back(simulator.node(i).result);
+        }
+    }
+    if (!is_chain(values)) {
+        LOG(ERROR) << "Invalid results";
+        return 1;
+    }
+}
@@ -1,6 +1,7 @@
 #include <fstream>
 
 #include "zheng_la.h"
+#include "general/net/env_config.h"
 #include "coordinator/la_coordinator.h"
 
 template<typename L>
@@ -44,6 +45,7 @@ int main(int argc, char *argv[]) {
         LOG(INFO) << "Starting protocol" << port << id;
         // Setup server
         ProtocolTcp<LatticeSet> protocol(port, id);
+        protocol.compact_types = net::configure_from_env(protocol.server, id, n);
 
         for (const auto &item: peers) {
             if (id != item.id) {
@@ -77,7 +79,7 @@ int main(int argc, char *argv[]) {
 
         std::cout << "Answer: " << std::endl;
 
-        for (auto elem: y.set) {
+        for (auto elem: y.elements()) {
             std::cout << elem << ' ';
         }
         std::cout << std::endl;
@@ -90,6 +92,7 @@ int main(int argc, char *argv[]) {
 
         // Wait before stopping protocol
         coordinator_client.wait_for_stop();
+        net::log_send_queue_stats(protocol.server);
         protocol.stop();
     } catch (std::exception &e) {
         LOG(ERROR) << "EXCEPTION" << e.what();
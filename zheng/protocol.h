@@ -1,12 +1,12 @@
 #pragma once
 
-#include <thread>
 #include <map>
 #include <atomic>
 #include <unordered_map>
 
 #include "general/net/server.h"
 #include "general/logger.h"
+#include "general/lattice_vector.h"
 
 enum MessageType : uint8_t {
     Write = 0,
@@ -18,20 +18,33 @@ enum MessageType : uint8_t {
 
 template<typename L>
 struct Callback {
-    virtual void receive_write_ack(const std::vector<std::pair<std::vector<L>, double>> &recVal, uint64_t rec_r, uint64_t message_id) = 0;
+    /**
+     * Acks and values arrive as lazy views into receive buffer, valid until the call returns.
+     * Handler deserializes them only when the message is not stale.
+     * Ack carries slots of the value accepted with k of the request that changed since the version
+     * the requester said it holds, and the version the value has now.
+     */
+    virtual void receive_write_ack(uint64_t from, uint64_t version, const net::Lazy<LatticeVector<L>> &changes,
+                                   uint64_t rec_r, uint64_t message_id) = 0;
 
-    virtual void receive_read_ack(const std::vector<std::pair<std::vector<L>, double>> &recVal, uint64_t rec_r, uint64_t message_id) = 0;
+    virtual void receive_read_ack(uint64_t from, uint64_t version, const net::Lazy<LatticeVector<L>> &changes,
+                                  uint64_t rec_r, uint64_t message_id) = 0;
 
-    virtual void receive_value(const std::vector<L> &value, uint64_t message_id) = 0;
+    virtual void receive_value(const net::Lazy<LatticeVector<L>> &value, uint64_t message_id) = 0;
 
-    virtual void receive_write(const std::vector<L> &value, double k, uint64_t rec_r, uint64_t from, uint64_t message_id) = 0;
+    /**
+     * @param known Version of accepted value of every acceptor the writer holds, by acceptor id.
+     * Empty when the writer does not use the ack value
+     */
+    virtual void receive_write(const LatticeVector<L> &value, double k, uint64_t rec_r,
+                               const std::vector<uint64_t> &known, uint64_t from, uint64_t message_id) = 0;
 
-    virtual void receive_read(uint64_t rec_r, uint64_t from, uint64_t message_id) = 0;
+    virtual void receive_read(uint64_t rec_r, double k, uint64_t from, uint64_t message_id) = 0;
 
     virtual ~Callback() = default;
 };
 
-template<typename L>
+template<Lattice L>
 struct ProtocolTcp : net::IMessageReceivedCallback {
 
     std::atomic<uint64_t> message_id;
@@ -42,6 +55,17 @@ struct ProtocolTcp : net::IMessageReceivedCallback {
 
     net::Server server;
 
+    // bit per message type sent in compact encoding. Incoming messages are decoded in any encoding
+    uint32_t compact_types = 0;
+
+    /**
+     * @param type message type
+     * @return encoding of messages of @type
+     */
+    net::Encoding encoding_of(uint8_t type) const {
+        return (compact_types >> type) & 1 ? net::Encoding::Compact : net::Encoding::Fixed;
+    }
+
     explicit ProtocolTcp(uint64_t port, uint64_t id) : server(this, port), message_id(id * 1000) {}
 
     void add_process(const net::ProcessDescriptor &descriptor) {
@@ -72,29 +96,33 @@ private:
             LOG(INFO) << "New connection from" << from << "message_id:" << message_id_rec << "type:"
                       << (int) message_type;
             if (message_type == Value) {
-                std::vector<L> lv;
+                net::Lazy<LatticeVector<L>> lv;
                 message >> lv;
                 callback->receive_value(lv, message_id_rec);
             } else if (message_type == Write) {
-                std::vector<L> val;
+                LatticeVector<L> val;
                 double k;
                 uint64_t r;
-                message >> val >> k >> r;
-                callback->receive_write(val, k, r, from, message_id_rec);
+                std::vector<uint64_t> known;
+                message >> val >> k >> r >> known;
+                callback->receive_write(val, k, r, known, from, message_id_rec);
             } else if (message_type == Read) {
                 uint64_t r;
-                message >> r;
-                callback->receive_read(r, from, message_id_rec);
+                double k;
+                message >> r >> k;
+                callback->receive_read(r, k, from, message_id_rec);
             } else if (message_type == WriteAck) {
-                std::vector<std::pair<std::vector<L>, double>> val;
+                uint64_t version;
+                net::Lazy<LatticeVector<L>> changes;
                 uint64_t r;
-                message >> val >> r;
-                callback->receive_write_ack(val, r, message_id_rec);
+                message >> version >> changes >> r;
+                callback->receive_write_ack(from, version, changes, r, message_id_rec);
             } else if (message_type == ReadAck) {
-                std::vector<std::pair<std::vector<L>, double>> recVal;
+                uint64_t version;
+                net::Lazy<LatticeVector<L>> changes;
                 uint64_t r;
-                message >> recVal >> r;
-                callback->receive_read_ack(recVal, r, message_id_rec);
+                message >> version >> changes >> r;
+                callback->receive_read_ack(from, version, changes, r, message_id_rec);
             } else {
                 LOG(ERROR) << "Unknown message type" << (int)message_type;
                 throw std::runtime_error("Unknown message type " + std::to_string((int)message_type));
@@ -106,60 +134,36 @@ private:
     }
 
 public:
-    void send_write(const std::vector<L> &v, double k, uint64_t r, uint64_t from) {
+    /**
+     * @param known Version of accepted value of every acceptor that is already joined, empty when acks are
+     * not used. Acceptors answer with the slots changed since then
+     */
+    void send_write(const LatticeVector<L> &v, double k, uint64_t r, const std::vector<uint64_t> &known,
+                    uint64_t from) {
         message_cnt++;
-        std::thread([&, v, k, r, from]() {
+        server.post([this, v, k, r, known, from]() {
             uint8_t message_type = Write;
-            net::Message message;
-            message << message_type << from << message_id++ << v << k << r;
-            for (const auto &descriptor: processes) {
-                try {
-                    LOG(INFO) << ">> sending write to" << descriptor.second.id << "from" << from << "message id"
-                              << message_id;
-//                    auto client = get_socket(descriptor.second);
-
-
-//                    send_byte(client, message_type);
-//                    send_number(client, from);
-//                    send_number(client, cur_message_id);
-//                    send_lattice_vector(client, v);
-//                    send_double(client, k);
-//                    send_number(client, r);
-//                    free_socket(client);
-                    server.send(descriptor.second, message);
-                } catch (std::runtime_error &e) {
-                    LOG(ERROR) << "* Exception while send_write" << e.what();
-                }
-            }
-        }).detach();
+            auto message = net::Message::build_as(encoding_of(message_type), message_type, from,
+                                                  message_id++, v, k, r, known);
+            LOG(INFO) << ">> sending write from" << from << "message id" << message_id;
+            server.broadcast_retrying(processes, std::move(message));
+        });
     }
 
-    void send_read(uint64_t r, uint64_t from) {
+    void send_read(uint64_t r, double k, uint64_t from) {
         message_cnt++;
-        std::thread([&, r, from]() {
+        server.post([this, r, k, from]() {
             uint8_t message_type = Read;
-            net::Message message;
-            message << message_type << from << message_id++ << r;
-            for (const auto &descriptor: processes) {
-                try {
-                    uint64_t cur_message_id = message_id++;
-                    LOG(INFO) << ">> sending read to" << descriptor.second.id << "cur message id:" << cur_message_id;
-//                    auto client = get_socket(descriptor.second);
-//
-//                    send_byte(client, message_type);
-//                    send_number(client, from);
-//                    send_number(client, cur_message_id);
-//                    send_number(client, r);
-//                    free_socket(client);
-                    server.send(descriptor.second, message);
-                } catch (std::runtime_error &e) {
-                    LOG(ERROR) << "* Exception while send_read" << e.what();
-                }
-            }
-        }).detach();
+            uint64_t cur_message_id = message_id++;
+            auto message = net::Message::build_as(encoding_of(message_type), message_type, from,
+                                                  cur_message_id, r, k);
+            LOG(INFO) << ">> sending read, cur message id:" << cur_message_id;
+            server.broadcast_retrying(processes, std::move(message));
+        });
     }
 
-    void send_write_ack(uint64_t to, const std::vector<std::pair<std::vector<L>, double>> &recVal, uint64_t rec_r, uint64_t from, uint64_t cur_message_id) {
+    void send_write_ack(uint64_t to, uint64_t version, const LatticeVector<L> &changes, uint64_t rec_r, uint64_t from,
+                        uint64_t cur_message_id) {
         message_cnt++;
         uint8_t message_type = WriteAck;
         try {
@@ -167,9 +171,9 @@ public:
 
 //            auto client = get_socket(processes.at(to));
 
-            net::Message message;
-            message << message_type << from << cur_message_id << recVal << rec_r;
-            server.send(processes.at(to), message);
+            auto message = net::Message::build_as(encoding_of(message_type), message_type, from,
+                                                  cur_message_id, version, net::Lazy(changes), rec_r);
+            server.send_retrying(processes.at(to), message);
 //            send_byte(client, message_type);
 //            send_number(client, from);
 //            send_number(client, cur_message_id);
@@ -181,15 +185,15 @@ public:
         }
     }
 
-    void send_read_ack(uint64_t to, const std::vector<std::pair<std::vector<L>, double>> &recVal, uint64_t r, uint64_t from, uint64_t cur_message_id) {
+    void send_read_ack(uint64_t to, uint64_t version, const LatticeVector<L> &changes, uint64_t r, uint64_t from,
+                       uint64_t cur_message_id) {
         message_cnt++;
         uint8_t message_type = ReadAck;
         try {
             LOG(INFO) << ">> sending read ack to" << to << "cur message id:" << cur_message_id;
-            net::Message message;
-
-            message << message_type << from << cur_message_id << recVal << r;
-            server.send(processes.at(to), message);
+            auto message = net::Message::build_as(encoding_of(message_type), message_type, from,
+                                                  cur_message_id, version, net::Lazy(changes), r);
+            server.send_retrying(processes.at(to), message);
 
 //            auto client = get_socket(processes.at(to));
 //            send_byte(client, message_type);
@@ -203,28 +207,14 @@ public:
         }
     }
 
-    void send_value(const std::vector<L> &v, uint64_t from) {
+    void send_value(const LatticeVector<L> &v, uint64_t from) {
         message_cnt++;
-        std::thread([&, v, from]() {
+        server.post([this, v, from]() {
             uint8_t message_type = Value;
-            net::Message message;
-            message << message_type << from << message_id++ << v;
-            for (const auto &descriptor: processes) {
-                try {
-                    LOG(INFO) << ">> sending value to " << descriptor.second.id;
-//                    auto client = get_socket(descriptor.second);
-//
-//                    send_byte(client, message_type);
-//                    send_number(client, from);
-//                    send_number(client, cur_message_id);
-//                    send_lattice_vector(client, v);
-//                    free_socket(client);
-                    server.send(descriptor.second, message);
-                } catch (std::runtime_error &e) {
-                    LOG(ERROR) << "* Exception while send_value" << e.what();
-                }
-            }
-
-        }).detach();
+            auto message = net::Message::build_as(encoding_of(message_type), message_type, from,
+                                                  message_id++, net::Lazy(v));
+            LOG(INFO) << ">> sending value from" << from;
+            server.broadcast_retrying(processes, std::move(message));
+        });
     }
 };
@@ -1,16 +1,24 @@
 #pragma once
 
 #include <cmath>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
 #include <vector>
 #include <cstdint>
+#include <memory>
+#include <optional>
+#include <chrono>
 #include <condition_variable>
 
 #include "general/lattice_agreement.h"
 #include "general/lattice.h"
+#include "general/lattice_vector.h"
 
 #include "protocol.h"
 
-template<typename L>
+template<Lattice L>
 struct ZhengLA : LatticeAgreement<L>, Callback<L> {
 
     const uint64_t f;
@@ -18,9 +26,9 @@ struct ZhengLA : LatticeAgreement<L>, Callback<L> {
     double l;
     uint64_t i;
     uint64_t log_f;
-    uint64_t r;
+    uint64_t r = 0;
     ProtocolTcp<L> &protocol;
-    std::vector<L> v;
+    LatticeVector<L> v;
 
     uint64_t value_received = 0;
     uint64_t read_ack_received = 0;
@@ -28,7 +36,6 @@ struct ZhengLA : LatticeAgreement<L>, Callback<L> {
 
     std::condition_variable cv;
     std::mutex cv_m;
-    std::unique_lock<std::mutex> lk{cv_m};
 
     uint64_t wait_time = 0;
 
@@ -43,172 +50,232 @@ struct ZhengLA : LatticeAgreement<L>, Callback<L> {
         Slave
     };
 
-    L start(const L &x) override {
+    /**
+     * What the process waits for
+     */
+    enum Stage {
+        // n - f values
+        Values,
+        // n - f acks of write of v
+        Write,
+        // n - f read acks, w is built from them
+        Read,
+        // n - f acks of write of w, w is built from them as well
+        WriteW,
+        Done
+    };
 
-        v[i] = x;
+    L start(const L &x) override {
+        std::unique_lock<std::mutex> lk(cv_m);
+        propose(x);
+        while (true) {
+            if (auto y = step()) {
+                return *y;
+            }
+            auto begin = std::chrono::steady_clock::now();
+            cv.wait(lk);
+            auto end = std::chrono::steady_clock::now();
+            wait_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+        }
+    }
 
+    /**
+     * Send own value and wait for values of others. Does not block. Caller holds cv_m
+     * @param x proposed value
+     */
+    void propose(const L &x) {
+        v.join_slot(i, x);
         protocol.send_value(v, i);
+        delta = f / 2.;
+        stage = Values;
         LOG(INFO) << "Waiting for values";
-        auto begin = std::chrono::steady_clock::now();
-        cv.wait(lk, [&] {
-//            LOG(ERROR) << "CHECK";
-            return value_received >= n - f;
-        });
-        auto end = std::chrono::steady_clock::now();
-        wait_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-        LOG(INFO) << "All values received ";
-
-        double delta = f / 2.;
-        for (r = 1; r <= log_f; ++r) {
-            LOG(INFO) << "classifier iteration: " << r;
-            Class c = classifier(l);
-            delta /= 2.;
-            if (c == Master) {
-                v = w;
-                l = l + delta;
-            } else {
-                l = l - delta;
-            }
-            LOG(INFO) << "classifier iteration done: " << r;
-        }
+    }
 
-        L y;
-        for (size_t j = 0; j < n; ++j) {
-            y = L::join(y, v[j]);
+    /**
+     * Pass every stage whose quorum was reached, sending what the next stage needs. Does not block,
+     * start() calls it after every wake up. Caller holds cv_m
+     * @return decided value once the last classifier round is done
+     */
+    std::optional<L> step() {
+        uint64_t quorum = n - f;
+        while (true) {
+            switch (stage) {
+                case Values:
+                    if (value_received < quorum) return {};
+                    LOG(INFO) << "All values received ";
+                    r = 1;
+                    begin_round();
+                    break;
+                case Write:
+                    if (write_ack_received < quorum) return {};
+                    write_ack_received = 0;
+                    LOG(INFO) << "Done waiting for send ack";
+                    protocol.send_read(r, k, i);
+                    build_w = true;
+                    stage = Read;
+                    break;
+                case Read: {
+                    if (read_ack_received < quorum) return {};
+                    read_ack_received = 0;
+                    build_w = false;
+                    uint64_t h = w.count_nonempty();
+                    if ((double) h > k) {
+                        build_wp = true;
+                        // acceptors answer with what changed since their read ack
+                        protocol.send_write(w, k, r, known, i);
+                        stage = WriteW;
+                    } else {
+                        end_round(Slave);
+                    }
+                    break;
+                }
+                case WriteW:
+                    if (write_ack_received < quorum) return {};
+                    write_ack_received = 0;
+                    build_wp = false;
+                    end_round(Master);
+                    break;
+                case Done:
+                    return decided;
+            }
         }
-        lk.unlock();
-        return y;
     }
 
-
-    std::vector<L> w;
+    LatticeVector<L> w;
     bool build_w = false;
     bool build_wp = false;
-
-    using AcceptValT = std::vector<std::pair<std::vector<L>, double>>;
-    std::vector<AcceptValT> acceptVal;
-
-
-    Class classifier(double k) {
-        w.assign(n, L{});
-
-        LOG(INFO) << "Waiting for send ack";
-        protocol.send_write(v, k, r, i);
-        auto begin = std::chrono::steady_clock::now();
-        while (write_ack_received < n - f) cv.wait(lk);
-        auto end = std::chrono::steady_clock::now();
-        wait_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-        write_ack_received = 0;
-        LOG(INFO) << "Done waiting for send ack";
-
-
-        protocol.send_read(r, i);
-        build_w = true;
-        begin = std::chrono::steady_clock::now();
-        while (read_ack_received < n - f) cv.wait(lk);
-        end = std::chrono::steady_clock::now();
-        wait_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-        read_ack_received = 0;
-        build_w = false;
-
-        uint64_t h = 0;
-        for (size_t j = 0; j < n; ++j) {
-            if (!w[j].set.empty()) {
-                ++h;
-            }
+    // version of value accepted by each acceptor in this round that is joined into w, 0 when none is
+    std::vector<uint64_t> known;
+
+    // join of every value accepted in a round with the same k. Proposers join all values accepted with their k,
+    // so one joined value answers them like the list of accepted values did
+    using AcceptedByK = std::map<double, std::shared_ptr<LatticeVector<L>>>;
+    // accepted values per round. Acks hold snapshots, so a value is copied only when it grows while shared
+    std::vector<AcceptedByK> acceptVal;
+
+private:
+    Stage stage = Values;
+    // step of l in the next round
+    double delta = 0;
+    // classifier threshold of current round
+    double k = 0;
+    std::optional<L> decided;
+
+    /**
+     * Start classifier round r, or decide when every round is done
+     */
+    void begin_round() {
+        if (r > log_f) {
+            L y;
+            v.for_each_nonempty([&](size_t, const L &value) {
+                y.join_into(value);
+            });
+            decided = y;
+            stage = Done;
+            return;
         }
+        LOG(INFO) << "classifier iteration: " << r;
+        k = l;
+        w = LatticeVector<L>(n);
+        known.assign(n, 0);
+        LOG(INFO) << "Waiting for send ack";
+        protocol.send_write(v, k, r, known, i);
+        stage = Write;
+    }
 
-        if ((double)h > k) {
-            build_wp = true;
-            protocol.send_write(w, k, r, i);
-            begin = std::chrono::steady_clock::now();
-            while (write_ack_received < n - f) cv.wait(lk);
-            end = std::chrono::steady_clock::now();
-            wait_time += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
-            write_ack_received = 0;
-            build_wp = false;
-            return Master;
+    void end_round(Class c) {
+        delta /= 2.;
+        if (c == Master) {
+            v = w;
+            l = l + delta;
         } else {
-            return Slave;
+            l = l - delta;
         }
+        LOG(INFO) << "classifier iteration done: " << r;
+        ++r;
+        begin_round();
     }
 
-    void receive_write_ack(const AcceptValT &recVal, uint64_t rec_r, uint64_t message_id) override {
+public:
+    void receive_write_ack(uint64_t, uint64_t, const net::Lazy<LatticeVector<L>> &changes,
+                           uint64_t rec_r, uint64_t message_id) override {
         cv_m.lock();
         LOG(INFO) << "<< write ack received" << message_id << (rec_r == r);
         if (rec_r == r) {
             write_ack_received++;
             if (build_wp) {
-                for (auto &elem: recVal) {
-                    if (elem.second == l) {
-                        for (size_t j = 0; j < n; ++j) {
-                            w[j] = L::join(w[j], elem.first[j]);
-                        }
-                    }
-                }
+                // slots changed since the version of @from joined into w, or all of them
+                w.join_into(changes.get());
             }
         }
         cv.notify_all();
         cv_m.unlock();
     }
 
-    void receive_read_ack(const AcceptValT &recVal, uint64_t rec_r, uint64_t message_id) override {
+    void receive_read_ack(uint64_t from, uint64_t version, const net::Lazy<LatticeVector<L>> &changes,
+                          uint64_t rec_r, uint64_t message_id) override {
         cv_m.lock();
         LOG(INFO) << "<< read ack received" << message_id << (rec_r == r) << build_w;
-        if (rec_r == r && build_w) {
-//            std::cout << "locked" << std::endl;
-            for (auto &elem: recVal) {
-                if (elem.second == l) {
-                    for (size_t j = 0; j < n; ++j) {
-                        w[j] = L::join(w[j], elem.first[j]);
-                    }
-                }
-            }
+        if (rec_r == r && build_w && from < n) {
+            w.join_into(changes.get());
+            known[from] = std::max(known[from], version);
             read_ack_received++;
         }
         cv.notify_all();
         cv_m.unlock();
     }
 
-    void receive_value(const std::vector<L> &value, uint64_t message_id) override {
+    void receive_value(const net::Lazy<LatticeVector<L>> &value, uint64_t message_id) override {
         cv_m.lock();
 //        LOG(ERROR) << "<< value received" << message_id;
         if (value_received < n - f) {
-            for (size_t k = 0; k < n; ++k) {
-                v[k] = L::join(v[k], value[k]);
-            }
+            v.join_into(value.get());
             value_received++;
         }
         cv.notify_all();
         cv_m.unlock();
     }
 
-    void receive_write(const std::vector<L> &value, double k, uint64_t rec_r, uint64_t from, uint64_t message_id) override {
-        cv_m.lock();
+    void receive_write(const LatticeVector<L> &value, double k, uint64_t rec_r, const std::vector<uint64_t> &held,
+                       uint64_t from, uint64_t message_id) override {
+        std::unique_lock<std::mutex> lk(cv_m);
         LOG(INFO) << "<< write received from " << from << " message id " << message_id;
-
-        if (!acceptValContains(acceptVal[rec_r], k, value)) {
-            acceptVal[rec_r].emplace_back(value, k);
+        std::shared_ptr<LatticeVector<L>> &accepted = accepted_value(rec_r, k);
+        if (accepted.use_count() > 1 && !(value <= *accepted)) {
+            accepted = std::make_shared<LatticeVector<L>>(*accepted);
         }
-        auto copy = acceptVal[rec_r];
-        cv_m.unlock();
-        protocol.send_write_ack(from, copy, rec_r, i, message_id);
-    }
-
-    bool acceptValContains(const AcceptValT &recVal, double k, const std::vector<L> &value) {
-        for (size_t j = 0; j < recVal.size(); ++j) {
-            if (recVal[j].second == k && recVal[j].first == value) {
-                return true;
-            }
+        accepted->join_into(value);
+        std::shared_ptr<const LatticeVector<L>> snapshot = accepted;
+        lk.unlock();
+        uint64_t since = i < held.size() ? held[i] : 0;
+        if (since == 0) {
+            protocol.send_write_ack(from, snapshot->version(), *snapshot, rec_r, i, message_id);
+        } else {
+            protocol.send_write_ack(from, snapshot->version(), snapshot->changes_since(since), rec_r, i, message_id);
         }
-        return false;
     }
 
-    void receive_read(uint64_t rec_r, uint64_t from, uint64_t message_id) override {
-        cv_m.lock();
+    void receive_read(uint64_t rec_r, double k, uint64_t from, uint64_t message_id) override {
+        std::unique_lock<std::mutex> lk(cv_m);
         LOG(INFO) << "<< read received from " << from << "message id" << message_id;
-        auto copy = acceptVal[rec_r];
-        cv_m.unlock();
-        protocol.send_read_ack(from, copy, rec_r, i, message_id);
+        std::shared_ptr<const LatticeVector<L>> snapshot = accepted_value(rec_r, k);
+        lk.unlock();
+        protocol.send_read_ack(from, snapshot->version(), *snapshot, rec_r, i, message_id);
+    }
+
+private:
+    /**
+     * Value accepted in round @rec_r with @k, created empty on first use. Caller holds cv_m
+     */
+    std::shared_ptr<LatticeVector<L>> &accepted_value(uint64_t rec_r, double k) {
+        if (rec_r >= acceptVal.size()) {
+            LOG(ERROR) << "Invalid round:" << rec_r;
+            throw std::runtime_error("Invalid round " + std::to_string(rec_r));
+        }
+        std::shared_ptr<LatticeVector<L>> &accepted = acceptVal[rec_r][k];
+        if (!accepted) {
+            accepted = std::make_shared<LatticeVector<L>>(n);
+        }
+        return accepted;
     }
 };